@@ -2,6 +2,21 @@
  * Program takes a text file with SIA instructions and outputs a binary file
  * of translated SIA machine code. Peruse code in HEX with:
  * od –x --endian=big [file] | head -5
+ *
+ * With --fat the output is a SIAF binary (see siaformat.h) instead: the machine code together with a
+ * table of its basic blocks and branch targets and every instruction already decoded, which siavm
+ * maps in and runs without decoding anything first.
+ * assemble --fat inputFile outputFile
+ *
+ * The source is mapped and split into words where it lies, mnemonics are found with a perfect hash
+ * and the machine code is written in one go at the end. -v echoes every line and its words as it is
+ * assembled, as the assembler always used to.
+ *
+ * --batch takes any number of input and output file pairs, --manifest a file listing one pair per line,
+ * and assembles them all in one run on -j threads (one per core by default). Each file's errors are
+ * printed under its name, then a summary of the throughput.
+ * assemble -j 4 --batch a.txt a.bin b.txt b.bin
+ * assemble --manifest files.txt
  */
 
 
@@ -10,42 +25,83 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
-
-char *words[5];
-int wordsSize;//numWords used to track number of words in words[] (to aid wordsToLower)
-
-
-/* Take a string. Split it into different words, putting them in the words array. For example:
+#include <stddef.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include "../siaformat.h"
+
+#define MAX_WORDS 5
+
+//Token - a word of the source, pointing into the mapped file. Words aren't 0 terminated.
+typedef struct Token {
+    const char *text;
+    int length;
+} Token;
+
+/* Assembly - everything about the file being assembled, so several files can be assembled on
+ * different threads at once. The mnemonic table is the only thing they share, and it is never written
+ * after main starts.
+ */
+typedef struct Assembly {
+    Token words[MAX_WORDS];
+    int wordsSize;//numWords used to track number of words in words[]
+    int verbose;//-v, echo each line and its words
+    FILE *log;//where the echo and errors go
+    unsigned int lines;
+    unsigned int errors;//bad instructions
+    size_t sourceBytes;
+    unsigned int codeBytes;
+} Assembly;
+
+
+/* Take a line of the source, from line up to end. Split it into different words, putting them in the
+ * words array. For example:
  * This is a string
  * Becomes:
  * words[0] = This
  * words[1] = is
  * words[2] = a
  * words[3] = string
- * Only safe when words is big enough...
+ * Runs of spaces count as one, and words past MAX_WORDS are ignored. Missing words are left empty.
  */
-//Note: getWords has two additional lines, one to reset wordsSize and another to increment it -Kyle
-void getWords(char *string) { 
-    printf ("\ninput: %s",string);
-    int curWord = 0;
-    wordsSize = 1;
-    char *cur = string;
-    words[curWord] = string;
-    while (*cur != 0) {
-        if (*cur == '\n' || *cur == '\r') *cur = ' ';
-        if (*cur == ' ') {
-            *cur = 0; // replace space with NULL
-            curWord++;
-            words[curWord] = cur+1; // set the start of the next word to the character after this one
-            wordsSize++;
-        } cur++; } for (int i=0;i<curWord;i++) 
-        printf ("word %d = %s\n",i,words[i]);
+void getWords(Assembly *as, const char *line, const char *end) {
+    as->wordsSize = 0;
+    for (const char *cur = line; cur < end && as->wordsSize < MAX_WORDS; ) {
+        if (*cur == ' ' || *cur == '\r') { cur++; continue; }
+        const char *start = cur;
+        while (cur < end && *cur != ' ' && *cur != '\r') cur++;
+        as->words[as->wordsSize++] = (Token){start, cur - start};
+    }
+    for (int i = as->wordsSize; i < MAX_WORDS; i++) as->words[i] = (Token){end, 0};
+
+    if (as->verbose) {
+        fprintf (as->log, "\ninput: %.*s\n", (int)(end - line), line);
+        for (int i=0;i<as->wordsSize;i++)
+            fprintf (as->log, "word %d = %.*s\n",i,as->words[i].length,as->words[i].text);
+    }
+}
+
+//getNumber - atoi for a word, which isn't 0 terminated
+int getNumber(Token word) {
+    int i = 0, sign = 1, value = 0;
+    if (i < word.length && (word.text[i] == '-' || word.text[i] == '+')) {
+        sign = (word.text[i++] == '-') ? -1 : 1;
+    }
+    while (i < word.length && isdigit((unsigned char)word.text[i])) {
+        value = value * 10 + (word.text[i++] - '0');
+    }
+    return sign * value;
 }
 
-// takes a string and returns register number or -1 if the string doesn't start with "r" or "R"
-int getRegister (char* string) {
-    if (string[0] != 'R' && string[0] != 'r') return -1;
-    return atoi(string+1);
+// takes a word and returns register number or -1 if the word doesn't start with "r" or "R"
+int getRegister (Token word) {
+    if (word.length == 0 || (word.text[0] != 'R' && word.text[0] != 'r')) return -1;
+    return getNumber((Token){word.text + 1, word.length - 1});
 }
 
 /* byteMe - Creates a new byte(char) from the low 4 bits of two ints
@@ -67,34 +123,56 @@ char lowByte(int num) {
     return (num & 255);
 }
 
-/* wordsToLower - converts the contents of global words[] to lower case
- * I noticed I left a number of capitalized words in my unit tests
- * and figured I could help make up for it by using the std lib funciton tolower
- * on each character of the input strings stored in words[].
- * Required a global to go with words[] tracking its size.
+/* Mnemonic lookup. MNEMONIC_FIRST and MNEMONIC_SECOND were picked so that every mnemonic in
+ * SIA_INSTRUCTIONS hashes to its own slot, from its first two letters and its length. Letters are
+ * folded to lower case by setting bit 5, so capitalized words in the unit tests still assemble.
+ * A word that hashes to a slot is still compared in full.
  */
-void wordsToLower() {
-    //iterate through words[] array
-    for (int i = 0; i < wordsSize; i++) {
-        int j = 0;
-        char *c = words[i];
-        //iterate through char string loooking for teminating 0
-        while (*c != 0){
-            //invoke tolower() on character
-            *c = tolower(*c);
-            j++;
-            c = words[i]+j;
+#define MNEMONIC_SLOTS 64
+#define MNEMONIC_FIRST 7
+#define MNEMONIC_SECOND 19
+
+unsigned char mnemonicSlots[MNEMONIC_SLOTS];//handler number for each slot, HANDLER_ILLEGAL if empty
+
+//mnemonicHash - the slot for a word of at least 2 characters, in any case
+unsigned int mnemonicHash(const char *text, int length) {
+    return ((text[0] | 32) * MNEMONIC_FIRST + (text[1] | 32) * MNEMONIC_SECOND + length) & (MNEMONIC_SLOTS - 1);
+}
+
+//buildMnemonicSlots - fills mnemonicSlots from the ISA's mnemonic table before main runs. Stops the
+//assembler if an instruction added to SIA_INSTRUCTIONS collides with another, pick new multipliers then.
+__attribute__((constructor)) static void buildMnemonicSlots(void) {
+    memset(mnemonicSlots, HANDLER_ILLEGAL, sizeof(mnemonicSlots));
+    for (int handler = 0; handler < HANDLER_ILLEGAL; handler++) {
+        const char *mnemonic = isaInstructions[handler].mnemonic;
+        unsigned int slot = mnemonicHash(mnemonic, strlen(mnemonic));
+        if (mnemonicSlots[slot] != HANDLER_ILLEGAL) {
+            printf ("mnemonics %s and %s hash to the same slot\n", isaInstructions[mnemonicSlots[slot]].mnemonic, mnemonic);
+            exit(1);
         }
+        mnemonicSlots[slot] = handler;
+    }
+}
+
+//lookupMnemonic - the handler number of the instruction a word names, HANDLER_ILLEGAL if none
+int lookupMnemonic(Token word) {
+    if (word.length < 2) return HANDLER_ILLEGAL;
+    int handler = mnemonicSlots[mnemonicHash(word.text, word.length)];
+    const char *mnemonic = isaInstructions[handler].mnemonic;
+    if (handler == HANDLER_ILLEGAL || (int)strlen(mnemonic) != word.length
+            || strncasecmp(word.text, mnemonic, word.length) != 0) {
+        return HANDLER_ILLEGAL;
     }
+    return handler;
 }
 
 /* Fills out the bytes array for all 3R instructions.
  * Takes an opcode and the bytes array, fills in the array and returns 2,
  * the length of 3R instructions in bytes.
  */
-int translate3R(int opcode, char *bytes) {
-    bytes[0] = byteMe(opcode, getRegister(words[1]));
-    bytes[1] = byteMe(getRegister(words[2]), getRegister(words[3]));
+int translate3R(Assembly *as, int opcode, char *bytes) {
+    bytes[0] = byteMe(opcode, getRegister(as->words[1]));
+    bytes[1] = byteMe(getRegister(as->words[2]), getRegister(as->words[3]));
     return 2;
 }
 
@@ -102,10 +180,10 @@ int translate3R(int opcode, char *bytes) {
  * Takes an int indicating branch type and the bytes array, fills in the array
  * and returns 4, the length of BR1 instructions in bytes.
  */
-int translateBR1(int branchtype, char *bytes) {
+int translateBR1(Assembly *as, int branchtype, char *bytes) {
     bytes[0] = byteMe(7, branchtype);
-    bytes[1] = byteMe(getRegister(words[1]), getRegister(words[2]));
-    int offset = (atoi(words[3]) / 2);
+    bytes[1] = byteMe(getRegister(as->words[1]), getRegister(as->words[2]));
+    int offset = (getNumber(as->words[3]) / 2);
     bytes[2] = highByte(offset);
     bytes[3] = lowByte(offset);
     return 4;
@@ -115,9 +193,9 @@ int translateBR1(int branchtype, char *bytes) {
  * Takes an int indicating call or jump, and the bytes array.
  * Fills in the array and returns 4, the length of BR2 instructions in bytes
  */
-int translateBR2(int branchtype, char *bytes) {
+int translateBR2(Assembly *as, int branchtype, char *bytes) {
     bytes[0] = byteMe(7, branchtype);
-    int address = (atoi(words[1]) / 2);
+    int address = (getNumber(as->words[1]) / 2);
     bytes[1] = address >> 16;
     bytes[2] = address >> 8;
     bytes[3] = address;
@@ -128,9 +206,9 @@ int translateBR2(int branchtype, char *bytes) {
  * Takes an opcode and the bytes array. fills in the array and returns 2,
  * the length of LS instructions in bytes
  */
-int translateLS(int opcode, char *bytes) {
-    bytes[0] = byteMe(opcode, getRegister(words[1]));
-    bytes[1] = byteMe(getRegister(words[2]), (atoi(words[3])));
+int translateLS(Assembly *as, int opcode, char *bytes) {
+    bytes[0] = byteMe(opcode, getRegister(as->words[1]));
+    bytes[1] = byteMe(getRegister(as->words[2]), (getNumber(as->words[3])));
     return 2;
 }
 
@@ -139,8 +217,8 @@ int translateLS(int opcode, char *bytes) {
  * Takes an int indicating the type of instruciton as well as the bytes array
  * Fills in the array and returns 2, the length of the instructions in bytes.
  */
-int translateStack(int type, char *bytes) {
-    bytes[0] = byteMe(10, getRegister(words[1]));
+int translateStack(Assembly *as, int type, char *bytes) {
+    bytes[0] = byteMe(10, getRegister(as->words[1]));
     bytes[1] = (type << 6) & 192;
     return 2;
 }
@@ -149,179 +227,428 @@ int translateStack(int type, char *bytes) {
  * Takes an opcode and the bytes array, fills in the array and
  * returns 2, the length of the instruciton in bytes
  */
-int translateMove(int opcode, char *bytes) {
+int translateMove(Assembly *as, int opcode, char *bytes) {
     //move instructions out of order?
     //Example: move -127 r1; sets register R1 to -127
     //| opcode | register | 8 bit imm value |
     //|words[0]| words[2] |    words[1]     |
-    bytes[0] = byteMe(opcode, getRegister(words[2]));
-    bytes[1] = atoi(words[1]);
+    bytes[0] = byteMe(opcode, getRegister(as->words[2]));
+    bytes[1] = getNumber(as->words[1]);
     return 2;
 }
 
 // Figure out from the first word which operation we are doing and do it...
-/* Parameter 0: char *string - string of chars representing 1 line from input file
- * Parameter 1: char *bytes - array of bites to hold assembly output
- * Returns: int - length of assembled instruction in bytes
+/* Parameter 0: Assembly *as - the file being assembled, its words are filled in from the line
+ * Parameter 1: const char *line - 1 line from input file, not including its newline
+ * Parameter 2: const char *end - end of the line
+ * Parameter 3: char *bytes - array of bites to hold assembly output
+ * Returns: int - length of assembled instruction in bytes, 0 for a blank line
  */
-int assembleLine(char *string, char *bytes) {
+int assembleLine(Assembly *as, const char *line, const char *end, char *bytes) {
     //tokenize input into words
-    getWords(string);
-
-    //convert all characters in words to lowercase
-    wordsToLower();
+    getWords(as, line, end);
+    if (as->wordsSize == 0) return 0;
 
-    /* What follows is a long if/else-if chain testing the first input word
-     * to see which instruction to translate. Each block calls the translator 
-     * funciton associated with that instruciton type. Halt and interrupt are 
-     * treated differently as they eschew some input.
+    /* Look the first input word up in the ISA's mnemonic table (siaisa.h), then translate
+     * the instruction by its format. Each format has its translator function. Halt and
+     * interrupt are treated differently as they eschew some input.
      */
-    //3R Instructions
-    //add - opcode 1
-    if (strcmp(words[0] ,"add") == 0) {
-        return translate3R(1, bytes);
+    int handler = lookupMnemonic(as->words[0]);
+    const IsaInstruction *isa = &isaInstructions[handler];
+
+    switch (isa->format) {
+        //3R instructions - add, and, divide, multiply, subtract, or
+        case FORMAT_3R:
+            return translate3R(as, isa->opcode, bytes);
+
+        //BR1 - relative branch instrucitons, opcode 7 with the branch type as opcode2
+        case FORMAT_BR1:
+            return translateBR1(as, isa->opcode2, bytes);
+
+        //BR2 absolute branch instructions - call and jump
+        case FORMAT_BR2:
+            return translateBR2(as, isa->opcode2, bytes);
+
+        //LS instrucitons - load and store
+        case FORMAT_LS:
+            return translateLS(as, isa->opcode, bytes);
+
+        //Stack instructions - return, push and pop
+        case FORMAT_STACK:
+            return translateStack(as, isa->opcode2, bytes);
+
+        //Move instructions
+        case FORMAT_MOVE:
+            return translateMove(as, isa->opcode, bytes);
+
+        //Interrupt opcode: 12, type: move
+        case FORMAT_INTERRUPT:
+            bytes[0] = byteMe(isa->opcode, 0);
+            bytes[1] = getNumber(as->words[1]);
+            return 2;
     }
 
-    //and - opcode 2
-    else if (strcmp(words[0] ,"and") == 0) {
-        return translate3R(2, bytes);
+    //HALT opcode: 0, type: 3R
+    if (handler == HANDLER_HALT) {
+        bytes[0] = 0;
+        bytes[1] = 0;
+        return 2;
     }
 
-    //divide - opcode 3
-    else if (strcmp(words[0] ,"divide") == 0) {
-        return translate3R(3, bytes);
-    }
+    //output error if instruction doesn't match any of the above options, though it might
+    //be more prudent to wipe the output file instead if the resulting machine code is bad
+    fprintf(as->log, "Error: Bad instruction!\nInstruction: %.*s.\n", as->words[0].length, as->words[0].text);
+    as->errors++;
+    return 0;
+}
 
-    //multiply - opcode 4
-    else if (strcmp(words[0] ,"multiply") == 0) {
-        return translate3R(4, bytes);
-    }
 
-    //subtract - opcode 5
-    else if (strcmp(words[0] ,"subtract") == 0) {
-        return translate3R(5, bytes);
-    }
 
-    //or - opcode 6
-    else if (strcmp(words[0] ,"or") == 0) {
-        return translate3R(6, bytes);
-    }
 
-    //BR1 - relative branch instrucitons - opcode 7
-    //branchifless
-    else if (strcmp(words[0] ,"branchifless") == 0) {
-        return translateBR1(0, bytes);
-    }
+/* putBigEndian - stores a 32-bit word big endian at bytes, the order SIAF header words are in
+ */
+void putBigEndian(unsigned char *bytes, unsigned int word) {
+    bytes[0] = word >> 24;
+    bytes[1] = word >> 16;
+    bytes[2] = word >> 8;
+    bytes[3] = word;
+}
 
-    //branchiflessorequal
-    else if (strcmp(words[0] ,"branchiflessorequal") == 0) {
-        return translateBR1(1, bytes);
-    }
+//alignUp - rounds offset up to a multiple of alignment, a power of two
+unsigned int alignUp(unsigned int offset, unsigned int alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
 
-    //branchifequal
-    else if (strcmp(words[0] ,"branchifequal") == 0) {
-        return translateBR1(2, bytes);
-    }
+//FatBlock - one entry of the block table, a PC and its FAT_ flags
+typedef struct FatBlock {
+    unsigned int pc;
+    unsigned int flags;
+} FatBlock;
+
+//compareBlocks - qsort comparison putting block table entries in PC order
+int compareBlocks(const void *a, const void *b) {
+    unsigned int first = ((const FatBlock *)a)->pc;
+    unsigned int second = ((const FatBlock *)b)->pc;
+    return (first > second) - (first < second);
+}
 
-    //branchifnotequal
-    else if (strcmp(words[0] ,"branchifnotequal") == 0) {
-        return translateBR1(3, bytes);
+/* writeFat - writes the assembled machine code out as a SIAF binary loaded and started at 0.
+ * Walks the code one instruction at a time, decoding each one into its record and noting where
+ * basic blocks start: at 0, at every branch, call and jump target, and after every branch, call,
+ * jump and return. Returns 0 if out of memory.
+ */
+int writeFat(FILE *out, unsigned char *code, unsigned int length) {
+    unsigned int recordCount = alignUp(length, FAT_PAGE_SIZE);
+    DecodedInstruction *records = calloc(recordCount ? recordCount : 1, sizeof(DecodedInstruction));
+    FatBlock *blocks = malloc((length + 1) * sizeof(FatBlock));
+    if (records == NULL || blocks == NULL) { free(records); free(blocks); return 0; }
+
+    unsigned int blockCount = 0;
+    blocks[blockCount++] = (FatBlock){0, FAT_BLOCK_START};
+    for (unsigned int pc = 0; pc < length; pc += records[pc].length) {
+        //the last instruction may run past the end of the code, memory there is the end of file byte
+        //siavm stores after the code and then 0
+        unsigned char instruction[4] = {0, 0, 0, 0};
+        unsigned int copied = (length - pc < 4) ? length - pc : 4;
+        memcpy(instruction, code + pc, copied);
+        if (copied < 4) instruction[copied] = 0xFF;
+        decodeBytes(instruction, pc, &records[pc]);
+        if (records[pc].opcode == 7) {
+            blocks[blockCount++] = (FatBlock){records[pc].target, FAT_BLOCK_START | FAT_BRANCH_TARGET};
+        }
+        if ((records[pc].opcode == 7 || records[pc].handler == HANDLER_RETURN) && pc + records[pc].length < length) {
+            blocks[blockCount++] = (FatBlock){pc + records[pc].length, FAT_BLOCK_START};
+        }
     }
 
-    //branchifgreater
-    else if (strcmp(words[0] ,"branchifgreater") == 0) {
-        return translateBR1(4, bytes);
+    //sort the table and merge entries for the same PC
+    qsort(blocks, blockCount, sizeof(FatBlock), compareBlocks);
+    unsigned int merged = 0;
+    for (unsigned int i = 0; i < blockCount; i++) {
+        if (merged > 0 && blocks[merged - 1].pc == blocks[i].pc) blocks[merged - 1].flags |= blocks[i].flags;
+        else blocks[merged++] = blocks[i];
     }
-
-    //branchifgreaterorequal
-    else if (strcmp(words[0] ,"branchifgreaterorequal") == 0) {
-        return translateBR1(5, bytes);
+    blockCount = merged;
+
+    //header, block table, records, and the code last on its own page
+    unsigned int blockOffset = FAT_HEADER_SIZE;
+    unsigned int recordOffset = alignUp(blockOffset + blockCount * 8, 64);
+    unsigned int codeOffset = alignUp(recordOffset + recordCount * sizeof(DecodedInstruction), FAT_CODE_ALIGN);
+    unsigned char *file = calloc(codeOffset + length, 1);
+    if (file == NULL) { free(records); free(blocks); return 0; }
+
+    FatHeader header = {FAT_MAGIC, FAT_VERSION, 0, 0, 0, codeOffset, length, blockOffset, blockCount,
+        recordOffset, 0, recordCount, sizeof(DecodedInstruction), 0, {0, 0}};
+    unsigned int *words = (unsigned int *)&header;
+    for (unsigned int i = 0; i < FAT_HEADER_SIZE / 4; i++) {
+        putBigEndian(file + 4 * i, words[i]);
     }
-
-    //BR2 absolute branch instructions - opcode 7
-    //call
-    else if (strcmp(words[0] ,"call") == 0) {
-        return translateBR2(6, bytes);
+    unsigned int byteOrder = FAT_BYTE_ORDER;
+    memcpy(file + offsetof(FatHeader, byteOrder), &byteOrder, sizeof(byteOrder));
+    for (unsigned int i = 0; i < blockCount; i++) {
+        putBigEndian(file + blockOffset + 8 * i, blocks[i].pc);
+        putBigEndian(file + blockOffset + 8 * i + 4, blocks[i].flags);
     }
+    memcpy(file + recordOffset, records, recordCount * sizeof(DecodedInstruction));
+    memcpy(file + codeOffset, code, length);
+
+    fwrite(file, codeOffset + length, 1, out);
+    free(file);
+    free(records);
+    free(blocks);
+    return 1;
+}
 
-    //jump
-    else if (strcmp(words[0] ,"jump") == 0) {
-        return translateBR2(7, bytes);
-    }
 
-    //LS instruciton
-    //load - opcode 8
-    else if (strcmp(words[0] ,"load") == 0) {
-        return translateLS(8, bytes);
-    }
+/* mapSource - maps the whole input file read only, sets size to its length. Returns NULL if it can't be
+ * opened, and an empty string for an empty file, which can't be mapped.
+ */
+const char *mapSource(const char *filename, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    if (fstat(fd, &info) != 0) { close(fd); return NULL; }
+    *size = info.st_size;
+    if (*size == 0) { close(fd); return ""; }
+    const char *source = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (source == MAP_FAILED) return NULL;
+    madvise((void *)source, *size, MADV_SEQUENTIAL);
+    return source;
+}
 
-    //store - opcode 9
-    else if (strcmp(words[0] ,"store") == 0) {
-        return translateLS(9, bytes);
-    }
 
-    //Stack instructions - opcode 10
-    //return
-    else if (strcmp(words[0] ,"return") == 0) {
-        return translateStack(0, bytes);
+/* assembleFile - assembles input into output, raw machine code or with fat a SIAF binary. Fills in the
+ * counts in as and reports problems to as->log. Returns 0 if the file assembled without errors, 1 if it
+ * couldn't be read or written or had bad instructions.
+ */
+int assembleFile(Assembly *as, const char *input, const char *output, int fat) {
+    size_t size;
+    const char *source = mapSource(input, &size);
+    if (source == NULL) { fprintf (as->log, "unable to open input file %s\n", input); return 1; }
+    as->sourceBytes = size;
+
+    //every instruction is assembled straight into the end of code, which always has room for one more
+    unsigned int codeLength = 0, codeCapacity = size / 2 + 4;
+    unsigned char *code = malloc(codeCapacity);
+    const char *end = source + size;
+    for (const char *line = source; code != NULL && line < end; ) {
+        const char *lineEnd = memchr(line, '\n', end - line);
+        if (lineEnd == NULL) lineEnd = end;
+        if (codeLength + 4 > codeCapacity) {
+            codeCapacity *= 2;
+            unsigned char *grown = realloc(code, codeCapacity);
+            if (grown == NULL) { free(code); code = NULL; break; }
+            code = grown;
+        }
+        codeLength += assembleLine(as, line, lineEnd, (char *)code + codeLength);
+        as->lines++;
+        line = lineEnd + 1;
     }
-
-    //push
-    else if (strcmp(words[0] ,"push") == 0) {
-        return translateStack(1, bytes);
+    if (size > 0) munmap((void *)source, size);
+    if (code == NULL) { fprintf (as->log, "out of memory\n"); return 1; }
+    as->codeBytes = codeLength;
+
+    int status = as->errors != 0;
+    FILE *out = fopen(output,"wb");
+    if (out == NULL) {
+        fprintf (as->log, "unable to open output file %s\n", output);
+        status = 1;
     }
-
-    //pop
-    else if (strcmp(words[0] ,"pop") == 0) {
-        return translateStack(2, bytes);
+    else {
+        int written = fat ? writeFat(out, code, codeLength) : (codeLength == 0 || fwrite(code, codeLength, 1, out) == 1);
+        if (fclose(out) != 0 || !written) {
+            fprintf (as->log, "unable to write output file %s\n", output);
+            status = 1;
+        }
     }
+    free(code);
+    return status;
+}
 
-    //Move instructions
-    //move - opcode 11
-    else if (strcmp(words[0] ,"move") == 0) {
-        return translateMove(11, bytes);
-    }
 
 
-    //Halt and Interrupt are distinct from the other instructions as they ignore some input.
-    //HALT opcode: 0, type: 3R
-    else if (strcmp(words[0] ,"halt") == 0) {
-        bytes[0] = 0;
-        bytes[1] = 0;
-        return 2;
+///////////
+// Batch //
+///////////
+// --batch and --manifest assemble many files in one run, on a pool of threads that each take the next
+// file until there are none left. Every file gets its own Assembly, and its echo and errors are kept in
+// a temporary file and printed after the others, in the order the files were given.
+
+//BatchJob - one file to assemble
+typedef struct BatchJob {
+    const char *input;
+    const char *output;
+    Assembly as;
+    int status;
+    double seconds;
+} BatchJob;
+
+//shared between the workers
+typedef struct Batch {
+    BatchJob *jobs;
+    int count;
+    int next;           //next job to hand out, taken with an atomic increment
+    int fat;
+    char *paths;        //--manifest: the manifest's paths, which the jobs point into
+} Batch;
+
+//elapsedSeconds - seconds since start
+double elapsedSeconds(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//batchWorker - thread body, assembles files until there are none left
+void *batchWorker(void *argument) {
+    Batch *batch = argument;
+    int index;
+    while ((index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+        BatchJob *job = &batch->jobs[index];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        job->as.log = tmpfile();
+        if (job->as.log == NULL) {
+            job->status = 1;
+            continue;
+        }
+        job->status = assembleFile(&job->as, job->input, job->output, batch->fat);
+        job->seconds = elapsedSeconds(&start);
     }
+    return NULL;
+}
 
-    //Interrupt opcode: 12, type: move
-    else if (strcmp(words[0] ,"interrupt") == 0) {
-        bytes[0] = byteMe(12, 0);
-        bytes[1] = atoi(words[1]);
-        return 2;
+/* runBatch - assembles every job of batch on threads workers, then prints each file's result and
+ * messages and a summary of the throughput. Returns 1 if any file failed.
+ */
+int runBatch(Batch *batch, int threads) {
+    //no more threads than files, and at least one even for an empty manifest
+    if (threads > batch->count) threads = batch->count;
+    if (threads < 1) threads = 1;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for (; workers != NULL && started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, batchWorker, batch) != 0) break;
+    }
+    //if no thread could be started do the work here
+    if (started == 0) batchWorker(batch);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    double seconds = elapsedSeconds(&start);
+    free(workers);
+
+    //report in order
+    int failed = 0;
+    unsigned long long lines = 0, sourceBytes = 0, codeBytes = 0;
+    char buffer[4096];
+    for (int i = 0; i < batch->count; i++) {
+        BatchJob *job = &batch->jobs[i];
+        printf ("=== %s -> %s (status %d, %u bytes, %.3f ms) ===\n", job->input, job->output, job->status,
+            job->as.codeBytes, job->seconds * 1000);
+        if (job->as.log != NULL) {
+            rewind(job->as.log);
+            size_t length;
+            while ((length = fread(buffer, 1, sizeof(buffer), job->as.log)) > 0) fwrite(buffer, 1, length, stdout);
+            fclose(job->as.log);
+        }
+        else {
+            printf ("unable to create a log for %s\n", job->input);
+        }
+        failed += job->status != 0;
+        lines += job->as.lines;
+        sourceBytes += job->as.sourceBytes;
+        codeBytes += job->as.codeBytes;
     }
+    //the work was done here when no thread could be started
+    int used = started ? started : 1;
+    printf ("Assembled %d file%s (%d failed) on %d thread%s in %.3f s (%.1f files/s, %.0f lines/s, %.1f MB/s of source), %llu lines to %llu bytes\n",
+        batch->count, (batch->count == 1) ? "" : "s", failed, used, (used == 1) ? "" : "s", seconds, seconds > 0 ? batch->count / seconds : 0.0,
+        seconds > 0 ? lines / seconds : 0.0, seconds > 0 ? sourceBytes / seconds / 1e6 : 0.0, lines, codeBytes);
+    return failed != 0;
+}
 
-    //output error if instruction doesn't match any of the above options, though it might
-    //be more prudent to wipe the output file instead if the resulting machine code is bad
-    else {
-        printf("Error: Bad instruction!\nInstruction: %s.\n", words[0]);
+/* readManifest - adds a job to batch for each line of the manifest file, an input and an output path
+ * separated by spaces. Blank lines and lines starting with # are skipped. Returns 0 if the manifest
+ * can't be read or a line is malformed.
+ */
+int readManifest(Batch *batch, char *filename, int verbose) {
+    size_t size;
+    const char *manifest = mapSource(filename, &size);
+    if (manifest == NULL) { printf ("unable to open manifest %s\n", filename); return 0; }
+
+    //paths need terminating, so they are copied out of the mapping once, into one buffer
+    char *paths = batch->paths = malloc(size + 1);
+    batch->jobs = malloc((size / 4 + 1) * sizeof(BatchJob));
+    if (paths == NULL || batch->jobs == NULL) { printf ("out of memory\n"); return 0; }
+    memcpy(paths, manifest, size);
+    paths[size] = '\n';
+    if (size > 0) munmap((void *)manifest, size);
+
+    Assembly as = {.log = stdout};
+    int lineNumber = 0;
+    for (char *line = paths, *end = paths + size; line < end; ) {
+        char *lineEnd = memchr(line, '\n', end + 1 - line);
+        lineNumber++;
+        getWords(&as, line, lineEnd);
+        if (as.wordsSize > 0 && as.words[0].text[0] != '#') {
+            if (as.wordsSize != 2) {
+                printf ("%s line %d: expected an input and an output file\n", filename, lineNumber);
+                return 0;
+            }
+            char *input = (char *)as.words[0].text, *output = (char *)as.words[1].text;
+            input[as.words[0].length] = 0;
+            output[as.words[1].length] = 0;
+            batch->jobs[batch->count++] = (BatchJob){.input = input, .output = output, .as = {.verbose = verbose}};
+        }
+        line = lineEnd + 1;
     }
+    return 1;
 }
 
 
+int main (int argc, char **argv)  {
+    //-v echoes the input, --fat writes a SIAF binary, which needs all of the code before anything is written
+    int fat = 0, verbose = 0, threads = (int)sysconf(_SC_NPROCESSORS_ONLN), arg = 1;
+    char *manifest = NULL;
+    int batch = 0;
+    for (; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-v") == 0) verbose = 1;
+        else if (strcmp(argv[arg], "--fat") == 0) fat = 1;
+        else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) threads = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "--manifest") == 0 && arg + 1 < argc) manifest = argv[++arg];
+        else if (strcmp(argv[arg], "--batch") == 0) batch = 1;
+        else break;
+    }
+    int files = argc - arg;
+    if ((manifest != NULL && (batch || files != 0)) || (batch && (files == 0 || files % 2 != 0))
+            || (manifest == NULL && !batch && files != 2))  {
+        printf ("assemble [-v] [--fat] inputFile outputFile\n"
+                "assemble [-v] [--fat] [-j threads] --batch inputFile outputFile [inputFile outputFile ...]\n"
+                "assemble [-v] [--fat] [-j threads] --manifest manifestFile\n");
+        exit(1);
+    }
 
+    if (manifest == NULL && !batch) {
+        Assembly as = {.verbose = verbose, .log = stdout};
+        return assembleFile(&as, argv[arg], argv[arg + 1], fat);
+    }
 
-int main (int argc, char **argv)  {
-    if (argc != 3)  {printf ("assemble inputFile outputFile\n"); exit(1); }
-    FILE *in = fopen(argv[1],"r");
-    if (in == NULL) { printf ("unable to open input file\n"); exit(1); }
-    FILE *out = fopen(argv[2],"wb");
-    if (out == NULL) { printf ("unable to open output file\n"); exit(1); }
-
-    char bytes[4], inputLine[100];
-    while (!feof(in)) {
-        if (NULL != fgets(inputLine,100,in)) {
-            int outSize = assembleLine(inputLine,bytes);
-            fwrite(bytes,outSize,1,out);
+    Batch jobs = {.fat = fat};
+    if (manifest != NULL) {
+        if (!readManifest(&jobs, manifest, verbose)) exit(1);
+    }
+    else {
+        jobs.jobs = malloc(files / 2 * sizeof(BatchJob));
+        if (jobs.jobs == NULL) { printf ("out of memory\n"); exit(1); }
+        for (; arg < argc; arg += 2) {
+            jobs.jobs[jobs.count++] = (BatchJob){.input = argv[arg], .output = argv[arg + 1], .as = {.verbose = verbose}};
         }
     }
-    fclose(in);
-    fclose(out);
-}
\ No newline at end of file
+    int status = runBatch(&jobs, threads);
+    free(jobs.jobs);
+    free(jobs.paths);
+    return status;
+}
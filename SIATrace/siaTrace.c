@@ -0,0 +1,140 @@
+/* SIA Trace - decodes and compares siavm execution traces
+ * siavm --trace writes one binary record per instruction run: its PC and raw bytes, the register it
+ * wrote and the value, and the memory word it wrote and where. This program prints a trace as text,
+ * or walks two traces side by side and reports the first instruction where they differ, for example
+ * the pipeline against the fast engine:
+ * siavm.exe --trace pipe.trace file.bin
+ * siavm.exe --fast --trace fast.trace file.bin
+ * siaTrace.exe pipe.trace fast.trace
+ *
+ * Exit status is 0 when the traces match (or one was printed), 1 when they differ or can't be read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "../siaisa.h"
+#include "../siatrace.h"
+
+#define CONTEXT 8               //records printed before the first difference
+
+
+//openTrace - opens a trace file and checks its header, exits if it isn't a trace siaTrace can read
+FILE *openTrace(char *filename) {
+    FILE *in = fopen(filename, "rb");
+    if(in == NULL) {
+        printf("unable to open trace file %s\n", filename);
+        exit(1);
+    }
+    char magic[4];
+    unsigned int recordSize;
+    if(fread(magic, 1, 4, in) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0
+            || fread(&recordSize, sizeof(recordSize), 1, in) != 1 || recordSize != sizeof(TraceRecord)) {
+        printf("%s is not a siavm trace\n", filename);
+        exit(1);
+    }
+    return in;
+}
+
+//printRecord - prints one record as a line of text, prefixed by its index
+void printRecord(const char *prefix, unsigned long long index, TraceRecord *record) {
+    DecodedInstruction decoded;
+    decodeBytes(record->bytes, record->pc, &decoded);
+
+    printf("%s%10llu  0x%08x  %02X %02X", prefix, index, record->pc, record->bytes[0], record->bytes[1]);
+    if(decoded.length == 4) {
+        printf(" %02X %02X", record->bytes[2], record->bytes[3]);
+    }
+    else {
+        printf("      ");
+    }
+    printf("  %-22s", handlerNames[decoded.handler]);
+    if(record->reg != TRACE_NO_REGISTER) {
+        printf("  r%d = %d", record->reg, record->value);
+    }
+    if(record->wroteMemory) {
+        printf("  [0x%08x] = %d", record->address, record->memoryValue);
+    }
+    printf("\n");
+}
+
+//sameRecord - whether two records describe the same instruction with the same effects
+bool sameRecord(TraceRecord *a, TraceRecord *b) {
+    if(a->pc != b->pc || memcmp(a->bytes, b->bytes, 4) != 0 || a->reg != b->reg || a->wroteMemory != b->wroteMemory) {
+        return 0;
+    }
+    if(a->reg != TRACE_NO_REGISTER && a->value != b->value) {
+        return 0;
+    }
+    return !a->wroteMemory || (a->address == b->address && a->memoryValue == b->memoryValue);
+}
+
+//printTrace - prints every record of a trace
+int printTrace(char *filename) {
+    FILE *in = openTrace(filename);
+    TraceRecord record;
+    unsigned long long index = 0;
+    while(fread(&record, sizeof(record), 1, in) == 1) {
+        printRecord("", index++, &record);
+    }
+    fclose(in);
+    return 0;
+}
+
+//diffTraces - walks two traces together, reports the first record they differ at with the records
+//leading up to it
+int diffTraces(char *first, char *second) {
+    FILE *a = openTrace(first);
+    FILE *b = openTrace(second);
+    TraceRecord history[CONTEXT];   //the last records both traces agreed on, a ring
+    TraceRecord recordA, recordB;
+    unsigned long long index = 0;
+    int status = 0;
+    while(1) {
+        bool haveA = fread(&recordA, sizeof(recordA), 1, a) == 1;
+        bool haveB = fread(&recordB, sizeof(recordB), 1, b) == 1;
+        if(!haveA && !haveB) {
+            printf("Traces match: %llu instructions\n", index);
+            break;
+        }
+        if(haveA && haveB && sameRecord(&recordA, &recordB)) {
+            history[index % CONTEXT] = recordA;
+            index++;
+            continue;
+        }
+
+        printf("Traces differ at instruction %llu\n", index);
+        unsigned long long start = (index > CONTEXT) ? index - CONTEXT : 0;
+        for(unsigned long long i = start; i < index; i++) {
+            printRecord("  ", i, &history[i % CONTEXT]);
+        }
+        if(haveA) {
+            printRecord("< ", index, &recordA);
+        }
+        else {
+            printf("< %10llu  end of %s\n", index, first);
+        }
+        if(haveB) {
+            printRecord("> ", index, &recordB);
+        }
+        else {
+            printf("> %10llu  end of %s\n", index, second);
+        }
+        status = 1;
+        break;
+    }
+    fclose(a);
+    fclose(b);
+    return status;
+}
+
+
+int main (int argc, char **argv)  {
+    if (argc != 2 && argc != 3)  {printf ("siaTrace traceFile [otherTraceFile]\n"); exit(1); }
+
+    if(argc == 2) {
+        return printTrace(argv[1]);
+    }
+    return diffTraces(argv[1], argv[2]);
+}
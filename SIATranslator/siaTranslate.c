@@ -0,0 +1,463 @@
+/* SIA Translator - ahead-of-time translation of SIA binaries to C
+ * Program takes a binary file of SIA machine code, the same file siavm loads, and writes a standalone
+ * C file that runs the program natively. Build the output with the host compiler and compare its
+ * output to siavm's:
+ * siaTranslate.exe file.bin file.c && gcc -O2 -o file file.c && ./file
+ *
+ * Every basic block of the program becomes a labeled block of C. Guest registers become the locals
+ * r0-r15, and virtual memory becomes a static array holding the loaded image. Branches, calls and jumps
+ * go straight to their target's label. Returns take their address off the stack at runtime, so they go
+ * through a switch over every block start. Interrupts 0 and 1 call helpers that print the same register
+ * and memory dumps as siavm. Run with -v, the stack pointer is printed on every push, pop and return just like
+ * siavm -v.
+ *
+ * The translation follows control flow from the entry PC, which is 0 unless the binary has a SIAH or SIAF
+ * header. Code that is only reached through a return to an address that doesn't start a block, or code
+ * that modifies itself, can't be translated ahead of time.
+ * The translated program stops with an error if it reaches either case. Stores into code are allowed
+ * until the changed instruction is about to run, since the stack can grow over code siavm never reaches.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "../siaformat.h"
+
+//1KB virtual main memory, same as siavm: 1000 bytes are loaded and dumped, addresses are masked to 1024
+#define MEMORY_SIZE 1000
+#define MEMORY_MASK 1023
+
+unsigned char memoryImage[MEMORY_SIZE];
+bool reached[MEMORY_SIZE];  //an instruction starts here and is reachable from PC 0
+bool leader[MEMORY_SIZE];   //a basic block starts here
+unsigned char codeByte[MEMORY_SIZE]; //byte belongs to a translated instruction
+DecodedInstruction decoded[MEMORY_SIZE]; //the instruction at every PC, decoded as siavm decodes it
+
+//worklist of PCs still to be followed
+unsigned int worklist[MEMORY_SIZE];
+int worklistSize;
+
+//where the program starts, from its header if it has one. 0 keeps the top of memory for the stack pointer.
+unsigned int entry;
+unsigned int stackPointer;
+
+
+//loadFile - loads the binary exactly like siavm does. Headerless binaries are loaded at 0 and get the EOF
+//byte siavm stores after the program. "SIAH" and "SIAF" binaries are loaded at their address and start at
+//their entry PC and stack pointer; the translator finds the blocks itself, so a SIAF binary's records and
+//block table go unused.
+void loadFile(char *filename) {
+    FILE *in = fopen(filename,"rb");
+    if (in == NULL) {
+        printf("unable to open input file\n");
+        exit(1);
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    rewind(in);
+    unsigned char *bytes = malloc(size > 0 ? size : 1);
+    if (bytes == NULL || (size > 0 && fread(bytes, size, 1, in) != 1)) {
+        printf("unable to read input file\n");
+        exit(1);
+    }
+    fclose(in);
+
+    unsigned long long address = 0, offset = 0, length = size;
+    bool isFat = 0;
+    if (size >= HEADER_SIZE && bigEndianWord(bytes) == HEADER_MAGIC) {
+        address = bigEndianWord(bytes + 4);
+        entry = bigEndianWord(bytes + 8);
+        stackPointer = bigEndianWord(bytes + 12);
+        offset = HEADER_SIZE;
+        length = size - offset;
+    }
+    else if (size >= FAT_HEADER_SIZE && bigEndianWord(bytes) == FAT_MAGIC) {
+        FatHeader fat;
+        if (!readFatHeader(bytes, size, &fat)) {
+            printf("bad SIAF header\n");
+            exit(1);
+        }
+        address = fat.address;
+        entry = fat.entry;
+        stackPointer = fat.stackPointer;
+        offset = fat.codeOffset;
+        length = fat.codeLength;
+        isFat = 1;
+    }
+
+    if (address + length > MEMORY_SIZE || entry >= MEMORY_SIZE || stackPointer > MEMORY_SIZE) {
+        printf("program does not fit in memory\n");
+        exit(1);
+    }
+    memcpy(memoryImage + address, bytes + offset, length);
+    //headerless and SIAF code is followed by the end of file byte, as siavm loads it
+    if ((offset == 0 || isFat) && address + length < MEMORY_SIZE) {
+        memoryImage[address + length] = 0xFF;
+    }
+    free(bytes);
+}
+
+//decodeImage - decodes the instruction at every PC of the loaded image with siavm's decode table. Bytes
+//past the end of the image read as zero.
+void decodeImage() {
+    for(unsigned int pc = 0; pc < MEMORY_SIZE; pc++) {
+        unsigned char instruction[4] = {0, 0, 0, 0};
+        for(unsigned int i = 0; i < 4 && pc + i < MEMORY_SIZE; i++) {
+            instruction[i] = memoryImage[pc + i];
+        }
+        decodeBytes(instruction, pc, &decoded[pc]);
+    }
+}
+
+//writesStackPointer - instruction changes R15, which ends its block so the stack check stays per block
+bool writesStackPointer(DecodedInstruction *instruction) {
+    int format = isaInstructions[instruction->handler].format;
+    if(format == FORMAT_3R) return instruction->reg3 == 15;
+    if(instruction->handler == HANDLER_LOAD || instruction->handler == HANDLER_MOVE) return instruction->reg1 == 15;
+    return format == FORMAT_STACK;
+}
+
+//endsBlock - instruction changes R15 or memory. Either ends its block, so the next block's checks run
+//before any instruction after it: a store or push may have rewritten the very next instruction.
+bool endsBlock(DecodedInstruction *instruction) {
+    return writesStackPointer(instruction) || instruction->handler == HANDLER_STORE;
+}
+
+//stops - instruction never falls through to the next one: halt, illegal instructions, and every control
+//transfer but the conditional branches
+bool stops(DecodedInstruction *instruction) {
+    return instruction->handler == HANDLER_HALT || instruction->handler == HANDLER_ILLEGAL
+        || ((isaFlags(instruction) & ISA_CONTROL) && isaInstructions[instruction->handler].format != FORMAT_BR1);
+}
+
+//follow - queue a PC to be translated, marking it as the start of a block if asked
+void follow(unsigned int pc, bool isLeader) {
+    if(pc + 4 > MEMORY_SIZE) {
+        return; //outside virtual memory, the translated program reports it if it ever gets there
+    }
+    if(isLeader) {
+        leader[pc] = 1;
+    }
+    if(!reached[pc]) {
+        reached[pc] = 1;
+        worklist[worklistSize++] = pc;
+    }
+}
+
+//findBlocks - walks the control flow from the entry PC, marking every reachable instruction and block start
+void findBlocks() {
+    follow(entry, 1);
+    while(worklistSize > 0) {
+        unsigned int pc = worklist[--worklistSize];
+        DecodedInstruction *instruction = &decoded[pc];
+        unsigned int next = pc + instruction->length;
+        for(unsigned int i = pc; i < next; i++) {
+            codeByte[i] = 1;
+        }
+
+        if((isaFlags(instruction) & ISA_CONTROL) && instruction->handler != HANDLER_RETURN) {
+            follow(instruction->target, 1);
+            if(isaInstructions[instruction->handler].format == FORMAT_BR1 || instruction->handler == HANDLER_CALL) {
+                //conditional branches fall through, and a call's next instruction is where it returns to
+                follow(next, 1);
+            }
+        }
+        else if(!stops(instruction)) {
+            //halt, return and illegal instructions don't fall through
+            follow(next, endsBlock(instruction));
+        }
+    }
+}
+
+//blockEnd - PC just past the block starting at start
+unsigned int blockEnd(unsigned int start) {
+    unsigned int pc = start;
+    do {
+        DecodedInstruction *instruction = &decoded[pc];
+        bool ends = (isaFlags(instruction) & ISA_CONTROL) || stops(instruction) || endsBlock(instruction);
+        pc += instruction->length;
+        if(ends) {
+            break;
+        }
+    } while(pc + 4 <= MEMORY_SIZE && !leader[pc]);
+    return pc;
+}
+
+
+/////////////////
+// Code output //
+/////////////////
+
+//the runtime every translated program starts with. Output formats match siavm exactly.
+const char *runtime =
+    "static int readWord(unsigned int loc) {\n"
+    "    return (virtualMemory[loc & 1023] << 24) | (virtualMemory[(loc + 1) & 1023] << 16)\n"
+    "        | (virtualMemory[(loc + 2) & 1023] << 8) | (virtualMemory[(loc + 3) & 1023]);\n"
+    "}\n"
+    "\n"
+    "static unsigned char modified[1024];\n"
+    "static int codeModified;\n"
+    "\n"
+    "static void writeWord(unsigned int loc, int value) {\n"
+    "    unsigned char bytes[4] = {value >> 24, value >> 16, value >> 8, value};\n"
+    "    for(unsigned int i = 0; i < 4; i++) {\n"
+    "        unsigned int at = (loc + i) & 1023;\n"
+    "        if(codeByte[at] && virtualMemory[at] != bytes[i]) {\n"
+    "            modified[at] = 1;\n"
+    "            codeModified = 1;\n"
+    "        }\n"
+    "        virtualMemory[at] = bytes[i];\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static int verbosity;\n"
+    "\n"
+    "static void moveStackPointer(int *stackPointer, int offset) {\n"
+    "    *stackPointer += offset;\n"
+    "    if(*stackPointer > 1000) {\n"
+    "        *stackPointer -= 1000;\n"
+    "    }\n"
+    "    if(*stackPointer < 0) {\n"
+    "        *stackPointer += 1000;\n"
+    "    }\n"
+    "    if(verbosity > 0) {\n"
+    "        printf(\"%d\\n\", *stackPointer);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static void dumpRegisters(int values[16]) {\n"
+    "    printf(\"Register contents: \\n\");\n"
+    "    for(int i = 0; i < 16; i++) {\n"
+    "        printf(\"Reg[%-2d]: %d\\n\", i, values[i]);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static void dumpMemory(void) {\n"
+    "    printf(\"Memory contents: \\n=================================================================\\n\");\n"
+    "    for(int i = 0; i < 1000; i++){\n"
+    "        if(i % 20 == 0 && i != 0)\n"
+    "            printf(\" %0 4d\\n\", (i-20));\n"
+    "        printf(\"%02X \", virtualMemory[i]);\n"
+    "    }\n"
+    "    printf(\" %0 4d\\n=================================================================\\n\", 980);\n"
+    "}\n"
+    "\n"
+    "static void checkStack(int stackPointer, unsigned int pc) {\n"
+    "    if(pc + 4 >= stackPointer) {\n"
+    "        printf(\"Error! Instructions and stack may have collided. Stack ptr: %d, PC: %d\\n\", stackPointer, pc);\n"
+    "        exit(1);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static void checkInstruction(int stackPointer, unsigned int pc, unsigned int length) {\n"
+    "    checkStack(stackPointer, pc);\n"
+    "    for(unsigned int i = pc; i < pc + length; i++) {\n"
+    "        if(modified[i]) {\n"
+    "            printf(\"Error! Instruction at %u was modified at runtime, self-modifying code can't be translated\\n\", pc);\n"
+    "            exit(1);\n"
+    "        }\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static void outsideMemory(int stackPointer, unsigned int pc) {\n"
+    "    checkStack(stackPointer, pc);\n"
+    "    printf(\"Error! PC %u is outside of virtual memory\\n\", pc);\n"
+    "    exit(1);\n"
+    "}\n"
+    "\n"
+    "static void illegalInstruction(int opcode, int opcode2, unsigned int pc) {\n"
+    "    printf(\"Error! Illegal instruction. Opcode: %d, Opcode2: %d, PC: %d\\n\", opcode, opcode2, pc);\n"
+    "    exit(1);\n"
+    "}\n"
+    "\n"
+    "static int divide(int dividend, int divisor, unsigned int pc) {\n"
+    "    if(divisor == 0 || (dividend == INT_MIN && divisor == -1)) {\n"
+    "        printf(\"Error! Can't divide %d by %d, PC: %d\\n\", dividend, divisor, pc);\n"
+    "        exit(1);\n"
+    "    }\n"
+    "    return dividend / divisor;\n"
+    "}\n"
+    "\n";
+
+//writeArray - writes one of the tables as a static C array covering every masked address, the bytes past
+//MEMORY_SIZE start as zero
+void writeArray(FILE *out, const char *declaration, unsigned char *bytes) {
+    fprintf(out, "%s[%d] = {", declaration, MEMORY_MASK + 1);
+    for(int i = 0; i < MEMORY_SIZE; i++) {
+        if(i % 20 == 0) {
+            fprintf(out, "\n   ");
+        }
+        fprintf(out, " 0x%02X,", bytes[i]);
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+//writeGoto - jumps to the block at target, or reports the error siavm would hit fetching outside memory
+void writeGoto(FILE *out, unsigned int target) {
+    if(target + 4 <= MEMORY_SIZE) {
+        fprintf(out, "goto L_%u;\n", target);
+    }
+    else {
+        fprintf(out, "outsideMemory(r15, %u);\n", target);
+    }
+}
+
+//writeInstruction - writes the C for one instruction. Control transfers jump to labels directly,
+//returns go through the dispatch switch.
+void writeInstruction(FILE *out, unsigned int pc) {
+    DecodedInstruction *instruction = &decoded[pc];
+    int reg1 = instruction->reg1, reg2 = instruction->reg2, reg3 = instruction->reg3;
+    static const char *conditions[] = {"<", "<=", "==", "!=", ">", ">="};
+
+    fprintf(out, "    //%d: %02X %02X\n", pc, memoryImage[pc], memoryImage[pc + 1]);
+    switch(instruction->handler) {
+        case HANDLER_HALT:
+            fprintf(out, "    return 0;\n");
+            break;
+
+        case HANDLER_ADD:
+            fprintf(out, "    r%d = r%d + r%d;\n", reg3, reg1, reg2);
+            break;
+        case HANDLER_AND:
+            fprintf(out, "    r%d = r%d & r%d;\n", reg3, reg1, reg2);
+            break;
+        case HANDLER_DIVIDE://divide stops with siavm's error instead of trapping
+            fprintf(out, "    r%d = divide(r%d, r%d, %u);\n", reg3, reg1, reg2, pc);
+            break;
+        case HANDLER_MULTIPLY:
+            fprintf(out, "    r%d = r%d * r%d;\n", reg3, reg1, reg2);
+            break;
+        case HANDLER_SUBTRACT:
+            fprintf(out, "    r%d = r%d - r%d;\n", reg3, reg1, reg2);
+            break;
+        case HANDLER_OR:
+            fprintf(out, "    r%d = r%d | r%d;\n", reg3, reg1, reg2);
+            break;
+
+        case HANDLER_BRANCHIFLESS: case HANDLER_BRANCHIFLESSOREQUAL: case HANDLER_BRANCHIFEQUAL:
+        case HANDLER_BRANCHIFNOTEQUAL: case HANDLER_BRANCHIFGREATER: case HANDLER_BRANCHIFGREATEROREQUAL:
+            fprintf(out, "    if(r%d %s r%d) ", reg1, conditions[instruction->opcode2], reg2);
+            writeGoto(out, instruction->target);
+            break;
+
+        case HANDLER_CALL: case HANDLER_JUMP:
+            fprintf(out, "    ");
+            writeGoto(out, instruction->target);
+            break;
+
+        case HANDLER_LOAD:
+            fprintf(out, "    r%d = readWord(r%d + %d);\n", reg1, reg2, instruction->immediate);
+            break;
+
+        case HANDLER_STORE:
+            fprintf(out, "    writeWord(r%d + %d, r%d);\n", reg2, instruction->immediate, reg1);
+            break;
+
+        case HANDLER_RETURN:
+            fprintf(out, "    target = readWord(r15);\n    moveStackPointer(&r15, 4);\n    goto dispatch;\n");
+            break;
+        case HANDLER_PUSH:
+            fprintf(out, "    moveStackPointer(&r15, -4);\n    writeWord(r15, r%d);\n", reg1);
+            break;
+        case HANDLER_POP:
+            fprintf(out, "    r%d = readWord(r15);\n    moveStackPointer(&r15, 4);\n", reg1);
+            break;
+
+        case HANDLER_MOVE:
+            fprintf(out, "    r%d = %d;\n", reg1, instruction->immediate);
+            break;
+
+        case HANDLER_INTERRUPT:
+            if(instruction->immediate == 0) {
+                fprintf(out, "    {\n        int values[16] = {r0, r1, r2, r3, r4, r5, r6, r7, r8, r9, r10, r11, r12, r13, r14, r15};\n");
+                fprintf(out, "        dumpRegisters(values);\n    }\n");
+            }
+            else if(instruction->immediate == 1) {
+                fprintf(out, "    dumpMemory();\n");
+            }
+            break;
+
+        default:
+            fprintf(out, "    illegalInstruction(%d, %d, %u);\n", instruction->opcode, instruction->opcode2, pc);
+            break;
+    }
+}
+
+//writeProgram - writes the whole translated program
+void writeProgram(FILE *out, char *source) {
+    fprintf(out, "/* Translated from %s by siaTranslate. */\n\n", source);
+    fprintf(out, "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n#include <limits.h>\n\n");
+    writeArray(out, "static unsigned char virtualMemory", memoryImage);
+    writeArray(out, "static const unsigned char codeByte", codeByte);
+    fputs(runtime, out);
+
+    fprintf(out, "int main(int argc, char **argv) {\n");
+    fprintf(out, "    verbosity = argc > 1 && strcmp(argv[1], \"-v\") == 0;\n");
+    fprintf(out, "    int r0 = 0, r1 = 0, r2 = 0, r3 = 0, r4 = 0, r5 = 0, r6 = 0, r7 = 0;\n");
+    fprintf(out, "    int r8 = 0, r9 = 0, r10 = 0, r11 = 0, r12 = 0, r13 = 0, r14 = 0, r15 = %u;\n",
+        stackPointer ? stackPointer : MEMORY_SIZE);
+    fprintf(out, "    unsigned int target = 0;\n    ");
+    writeGoto(out, entry);
+    fprintf(out, "\n");
+
+    //returns land here, every block start is a possible return address
+    fprintf(out, "dispatch:\n    switch(target) {\n");
+    for(unsigned int pc = 0; pc + 4 <= MEMORY_SIZE; pc++) {
+        if(leader[pc]) {
+            fprintf(out, "        case %u: goto L_%u;\n", pc, pc);
+        }
+    }
+    fprintf(out, "        default:\n");
+    fprintf(out, "            checkStack(r15, target);\n");
+    fprintf(out, "            printf(\"Error! Return to %%u, which is not the start of a translated block\\n\", target);\n");
+    fprintf(out, "            exit(1);\n    }\n\n");
+
+    for(unsigned int start = 0; start + 4 <= MEMORY_SIZE; start++) {
+        if(!leader[start]) {
+            continue;
+        }
+        unsigned int end = blockEnd(start);
+
+        //the fetch check for every instruction in the block at once, the stack pointer and memory can
+        //only change at the end of a block. A store that changed translated code also takes the slow path.
+        unsigned int last = start;
+        for(unsigned int pc = start; pc < end; pc += decoded[pc].length) {
+            last = pc;
+        }
+        fprintf(out, "L_%u:\n", start);
+        fprintf(out, "    if((unsigned int)r15 <= %uu || codeModified) {\n", last + 4);
+        for(unsigned int pc = start; pc < end; pc += decoded[pc].length) {
+            fprintf(out, "        checkInstruction(r15, %u, %d);\n", pc, decoded[pc].length);
+        }
+        fprintf(out, "    }\n");
+
+        for(unsigned int pc = start; pc < end; pc += decoded[pc].length) {
+            writeInstruction(out, pc);
+        }
+
+        //fall into the next block unless the last instruction already left
+        if(!stops(&decoded[last])) {
+            fprintf(out, "    ");
+            writeGoto(out, end);
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "}\n");
+}
+
+
+int main (int argc, char **argv)  {
+    if (argc != 3)  {printf ("siaTranslate inputFile outputFile\n"); exit(1); }
+
+    loadFile(argv[1]);
+    decodeImage();
+    findBlocks();
+
+    FILE *out = fopen(argv[2],"w");
+    if (out == NULL) { printf ("unable to open output file\n"); exit(1); }
+    writeProgram(out, argv[1]);
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,79 @@
+/* SIA Format - the SIAH and SIAF binary layouts, shared by siavm, the assembler and the translator
+ * A SIAF ("fat") binary carries the program together with what siavm would otherwise work out while
+ * running it. Everything is laid out so siavm can map the file and use it in place:
+ *   header      FAT_HEADER_SIZE bytes, the FatHeader words, big-endian like the SIAH header except byteOrder
+ *   blocks      blockCount pairs of big-endian words: a PC and its FAT_ flags, sorted by PC. Every basic
+ *               block start and every branch, call and jump target of the program is listed.
+ *   records     recordCount DecodedInstruction records in the host's layout, one per PC from recordStart.
+ *               Only PCs an instruction starts at are valid. recordStart and recordCount are whole pages of
+ *               FAT_PAGE_SIZE records, so siavm can hand each page to its decode table as it is.
+ *   code        codeLength bytes of machine code loaded at address, starting on a FAT_CODE_ALIGN boundary in
+ *               the file so it can be mapped straight into memory. Code is last, so the rest of its last
+ *               page maps in as zeros.
+ * The records are only used by a host with the same byteOrder and recordSize, anything else decodes the code
+ * itself as it would a raw binary.
+ */
+
+#ifndef SIAFORMAT_H
+#define SIAFORMAT_H
+
+#include <stddef.h>
+#include "siaisa.h"
+
+//Binary header. A binary may start with four big-endian words: the magic "SIAH", the address the program
+//is loaded at, the entry PC and the initial stack pointer (0 keeps the top of memory). Binaries without
+//one are loaded at 0 and start at PC 0. SIAF binaries have the header below instead.
+#define HEADER_MAGIC 0x53494148
+#define HEADER_SIZE 16
+
+//SIAF binary layout, see the top of this file
+#define FAT_MAGIC 0x53494146    //"SIAF"
+#define FAT_VERSION 1
+#define FAT_HEADER_SIZE 64
+#define FAT_BYTE_ORDER 0x01020304
+#define FAT_PAGE_SIZE 4096      //records per page, siavm's CODE_PAGE_SIZE
+#define FAT_CODE_ALIGN 4096     //code starts on a host page in the file
+
+//block table flags
+#define FAT_BLOCK_START 1       //a basic block starts here: PC 0, a target, or right after a control transfer
+#define FAT_BRANCH_TARGET 2     //a branch, call or jump goes here
+
+//FatHeader - the words at the start of a SIAF binary, in file order
+typedef struct FatHeader {
+    unsigned int magic;         //FAT_MAGIC
+    unsigned int version;       //FAT_VERSION
+    unsigned int address;       //where the code is loaded
+    unsigned int entry;         //PC execution starts at
+    unsigned int stackPointer;  //initial stack pointer, 0 keeps the top of memory
+    unsigned int codeOffset;
+    unsigned int codeLength;
+    unsigned int blockOffset;
+    unsigned int blockCount;
+    unsigned int recordOffset;
+    unsigned int recordStart;   //PC of the first record
+    unsigned int recordCount;
+    unsigned int recordSize;    //sizeof(DecodedInstruction) on the host that wrote the records
+    unsigned int byteOrder;     //FAT_BYTE_ORDER as the host that wrote the records stores it
+    unsigned int reserved[2];
+} FatHeader;
+
+_Static_assert(sizeof(FatHeader) == FAT_HEADER_SIZE, "FatHeader must match the SIAF header");
+
+//bigEndianWord - the 32-bit word stored big-endian at bytes
+static inline unsigned int bigEndianWord(const unsigned char *bytes) {
+    return ((unsigned int)bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+//readFatHeader - reads the header of a SIAF binary, returns 0 if its sections don't lie inside the file
+static inline bool readFatHeader(const unsigned char *bytes, unsigned long long size, FatHeader *header) {
+    unsigned int *words = (unsigned int *)header;
+    for(unsigned int i = 0; i < FAT_HEADER_SIZE / 4; i++) {
+        words[i] = bigEndianWord(bytes + 4 * i);
+    }
+    memcpy(&header->byteOrder, bytes + offsetof(FatHeader, byteOrder), sizeof(header->byteOrder));
+    return header->version == FAT_VERSION && header->codeOffset >= FAT_HEADER_SIZE
+        && (unsigned long long)header->codeOffset + header->codeLength <= size
+        && (unsigned long long)header->blockOffset + header->blockCount * 8ULL <= size;
+}
+
+#endif
@@ -0,0 +1,278 @@
+/* SIA ISA - the one description of the SIA instruction set, shared by siavm and the assembler
+ * SIA_INSTRUCTIONS lists every instruction once: its handler name, assembler mnemonic, opcode, secondary
+ * opcode, operand format and what it reads and does. Everything else is generated from the list:
+ *   the HANDLER_ numbers the engines dispatch on, and handlerNames for printing them
+ *   isaInstructions, the assembler's table of mnemonics, indexed by handler number
+ *   decodeTable, 65536 DecodedInstruction records, one for every value of an instruction's first two
+ *   bytes, filled in before main runs. Decoding an instruction is one load from the table; only the
+ *   4-byte branches take their offset or address from bytes 2 and 3 after it.
+ * Adding an instruction means adding its line here and its handler to the engines.
+ */
+
+#ifndef SIAISA_H
+#define SIAISA_H
+
+#include <stdbool.h>
+#include <string.h>
+
+//Operand formats. The format says where an instruction's fields sit in its bytes, and how the
+//assembler reads its operands.
+enum {
+    FORMAT_NONE,        //halt, and opcodes that aren't instructions
+    FORMAT_3R,          //opcode reg1 | reg2 reg3                          add r1 r2 r3
+    FORMAT_BR1,         //7 opcode2 | reg1 reg2 | 16 bit offset             branchifless r1 r2 offset
+    FORMAT_BR2,         //7 opcode2 | 24 bit address                       call address
+    FORMAT_LS,          //opcode reg1 | reg2 offset                        load r1 r2 offset
+    FORMAT_STACK,       //10 reg1 | opcode2 in the top 2 bits              push r1
+    FORMAT_MOVE,        //11 reg1 | 8 bit signed immediate                 move immediate r1
+    FORMAT_INTERRUPT    //12 0 | interrupt number                          interrupt number
+};
+
+//What an instruction reads and does, for stages that only need to know that much
+#define ISA_OPERANDS    1   //execute reads reg1 and reg2 as its two operands
+#define ISA_ADDRESS     2   //execute reads reg2 as an address
+#define ISA_STACK       4   //execute reads the stack pointer
+#define ISA_DATA        8   //execute reads reg1 as the value to push
+#define ISA_CONTROL     16  //changes the PC: branches, call, jump and return
+#define ISA_CALL        32
+#define ISA_RETURN      64
+
+//X(handler, mnemonic, opcode, opcode2, format, flags) - one line per instruction, in HANDLER_ order
+#define SIA_INSTRUCTIONS(X) \
+    X(HALT,                     "halt",                     0,  0, FORMAT_NONE,      0) \
+    X(ADD,                      "add",                      1,  0, FORMAT_3R,        ISA_OPERANDS) \
+    X(AND,                      "and",                      2,  0, FORMAT_3R,        ISA_OPERANDS) \
+    X(DIVIDE,                   "divide",                   3,  0, FORMAT_3R,        ISA_OPERANDS) \
+    X(MULTIPLY,                 "multiply",                 4,  0, FORMAT_3R,        ISA_OPERANDS) \
+    X(SUBTRACT,                 "subtract",                 5,  0, FORMAT_3R,        ISA_OPERANDS) \
+    X(OR,                       "or",                       6,  0, FORMAT_3R,        ISA_OPERANDS) \
+    X(BRANCHIFLESS,             "branchifless",             7,  0, FORMAT_BR1,       ISA_OPERANDS | ISA_CONTROL) \
+    X(BRANCHIFLESSOREQUAL,      "branchiflessorequal",      7,  1, FORMAT_BR1,       ISA_OPERANDS | ISA_CONTROL) \
+    X(BRANCHIFEQUAL,            "branchifequal",            7,  2, FORMAT_BR1,       ISA_OPERANDS | ISA_CONTROL) \
+    X(BRANCHIFNOTEQUAL,         "branchifnotequal",         7,  3, FORMAT_BR1,       ISA_OPERANDS | ISA_CONTROL) \
+    X(BRANCHIFGREATER,          "branchifgreater",          7,  4, FORMAT_BR1,       ISA_OPERANDS | ISA_CONTROL) \
+    X(BRANCHIFGREATEROREQUAL,   "branchifgreaterorequal",   7,  5, FORMAT_BR1,       ISA_OPERANDS | ISA_CONTROL) \
+    X(CALL,                     "call",                     7,  6, FORMAT_BR2,       ISA_CONTROL | ISA_CALL) \
+    X(JUMP,                     "jump",                     7,  7, FORMAT_BR2,       ISA_CONTROL) \
+    X(LOAD,                     "load",                     8,  0, FORMAT_LS,        ISA_ADDRESS) \
+    X(STORE,                    "store",                    9,  0, FORMAT_LS,        ISA_ADDRESS) \
+    X(RETURN,                   "return",                   10, 0, FORMAT_STACK,     ISA_STACK | ISA_CONTROL | ISA_RETURN) \
+    X(PUSH,                     "push",                     10, 1, FORMAT_STACK,     ISA_DATA) \
+    X(POP,                      "pop",                      10, 2, FORMAT_STACK,     ISA_STACK) \
+    X(MOVE,                     "move",                     11, 0, FORMAT_MOVE,      0) \
+    X(INTERRUPT,                "interrupt",                12, 0, FORMAT_INTERRUPT, 0) \
+    X(ILLEGAL,                  "illegal",                  13, 0, FORMAT_NONE,      0)
+
+//Handler numbers - one per opcode and opcode2 combination. The fast engine dispatches on these directly.
+#define ISA_HANDLER(handler, mnemonic, opcode, opcode2, format, flags) HANDLER_##handler,
+enum {
+    SIA_INSTRUCTIONS(ISA_HANDLER)
+    HANDLER_COUNT
+};
+#undef ISA_HANDLER
+
+//IsaInstruction - one line of SIA_INSTRUCTIONS
+typedef struct IsaInstruction {
+    const char *mnemonic;
+    unsigned char opcode;
+    unsigned char opcode2;
+    unsigned char format;   //FORMAT_ number
+    unsigned char flags;    //ISA_ flags
+} IsaInstruction;
+
+//every instruction by handler number. HANDLER_ILLEGAL stands for opcodes 13-15 and stack opcode2 3,
+//which the assembler never writes.
+#define ISA_ENTRY(handler, mnemonic, opcode, opcode2, format, flags) {mnemonic, opcode, opcode2, format, flags},
+static const IsaInstruction isaInstructions[HANDLER_COUNT] = {
+    SIA_INSTRUCTIONS(ISA_ENTRY)
+};
+#undef ISA_ENTRY
+
+//instruction names by handler number, for the --stats instruction mix
+#define ISA_NAME(handler, mnemonic, opcode, opcode2, format, flags) mnemonic,
+static const char *const handlerNames[HANDLER_COUNT] = {
+    SIA_INSTRUCTIONS(ISA_NAME)
+};
+#undef ISA_NAME
+
+//Predecoded instruction. Every instruction is pulled apart into a DecodedInstruction the first time it
+//is fetched, and the record is reused by decode, execute and store on every later fetch of the same PC.
+typedef struct DecodedInstruction {
+    unsigned char opcode;   //primary opcode, high 4 bits of the first octet
+    unsigned char opcode2;  //secondary opcode for branch (7) and stack (10) instructions
+    unsigned char handler;  //HANDLER_ number for this opcode/opcode2 combination
+    unsigned char reg1;     //3R/BR1 first register, load/store/stack/move data register
+    unsigned char reg2;     //3R/BR1 second register, load/store address register
+    unsigned char reg3;     //3R destination register
+    unsigned char length;   //2 or 4 bytes
+    bool valid;             //record holds a decoded instruction
+    int immediate;          //move immediate, load/store offset, interrupt number
+    unsigned int target;    //branch target, PC relative targets already resolved
+} DecodedInstruction;
+
+//isaFlags - the ISA_ flags of a decoded instruction
+static inline unsigned char isaFlags(const DecodedInstruction *instruction) {
+    return isaInstructions[instruction->handler].flags;
+}
+
+
+//highHalfByte - returns the high 4 bits from a given byte
+//shifted to the low 4 bits of the resultant byte
+static inline char highHalfByte(unsigned char byte) {
+    return (byte & 240) >> 4;
+}
+
+//lowHalfByte - returns the low 4 bits of a given byte
+//with the high 4 bits masked out
+static inline char lowHalfByte(unsigned char byte) {
+    return (byte & 15);
+}
+
+//get3R - helper functions for decoding 3R instructions
+//get the first register from 3R instructions
+static inline unsigned char get3R1(const unsigned char instruction[4]) {
+    return lowHalfByte(instruction[0]);
+}
+
+//get the second register from 3R instrucitons
+static inline unsigned char get3R2(const unsigned char instruction[4]) {
+    return highHalfByte(instruction[1]);
+}
+
+//get the third register from 3R instructions
+static inline unsigned char get3R3(const unsigned char instruction[4]) {
+    return lowHalfByte(instruction[1]);
+}
+
+//getBR - helper functions for decoding br1 instructions
+//get the first register from BR1 instructions
+static inline unsigned char getBR1(const unsigned char instruction[4]) {
+    return highHalfByte(instruction[1]);
+}
+
+//get the second register from BR1 instrucitons
+//NOTE: not for BR2 instructions.
+static inline unsigned char getBR2(const unsigned char instruction[4]) {
+    return lowHalfByte(instruction[1]);
+}
+
+//getStackRegister - get register from stack instrucitons
+static inline unsigned char getStackRegister(const unsigned char instruction[4]) {
+    return lowHalfByte(instruction[0]);
+}
+
+//get register from move instructions
+static inline unsigned char getMoveRegister(const unsigned char instruction[4]) {
+    return lowHalfByte(instruction[0]);
+}
+
+//getImmediate - get the immediate value from move instructions,
+//and convert to signed.
+static inline signed char getImmediate(const unsigned char instruction[4]) {
+    signed char signedByte = instruction[1];
+
+    //conversion - is this actually necessary?
+    if((signedByte >> 7) == 1) {
+        signedByte -= 1;
+        signedByte = ~signedByte;
+    }
+
+    return signedByte;
+}
+
+//decodeTable - the record for every value of an instruction's first two bytes, first byte high
+static DecodedInstruction decodeTable[65536];
+
+//buildDecodeTable - fills decodeTable from SIA_INSTRUCTIONS before main runs. An opcode's format says
+//where its secondary opcode is, the opcode and secondary opcode pick the handler, and the handler's
+//format says where its fields are. Opcodes that aren't instructions keep what their format decodes,
+//so an illegal stack instruction still reports its secondary opcode.
+__attribute__((constructor)) static void buildDecodeTable(void) {
+    unsigned char opcodeFormat[16];
+    unsigned char handlers[16][16];
+    memset(opcodeFormat, FORMAT_NONE, sizeof(opcodeFormat));
+    memset(handlers, HANDLER_ILLEGAL, sizeof(handlers));
+    for(int handler = 0; handler < HANDLER_ILLEGAL; handler++) {
+        const IsaInstruction *isa = &isaInstructions[handler];
+        opcodeFormat[isa->opcode] = isa->format;
+        handlers[isa->opcode][isa->opcode2] = handler;
+    }
+
+    for(unsigned int word = 0; word < 65536; word++) {
+        unsigned char instruction[4] = {word >> 8, word & 255, 0, 0};
+        DecodedInstruction *record = &decodeTable[word];
+        record->opcode = highHalfByte(instruction[0]);
+        unsigned char format = opcodeFormat[record->opcode];
+        if(format == FORMAT_BR1 || format == FORMAT_BR2) {
+            record->opcode2 = lowHalfByte(instruction[0]);
+        }
+        else if(format == FORMAT_STACK) {
+            record->opcode2 = instruction[1] >> 6;
+        }
+        record->handler = handlers[record->opcode][record->opcode2];
+        if(record->handler != HANDLER_ILLEGAL) {
+            format = isaInstructions[record->handler].format;
+        }
+        record->length = (format == FORMAT_BR1 || format == FORMAT_BR2) ? 4 : 2;
+        record->valid = 1;
+
+        switch(format) {
+            case FORMAT_3R:
+                record->reg1 = get3R1(instruction);
+                record->reg2 = get3R2(instruction);
+                record->reg3 = get3R3(instruction);
+                break;
+
+            //BR1 - registers here, the offset comes from bytes 2 and 3
+            case FORMAT_BR1:
+                record->reg1 = getBR1(instruction);
+                record->reg2 = getBR2(instruction);
+                break;
+
+            //BR2 - the top 8 bits of the 24 bit address, bytes 2 and 3 hold the rest
+            case FORMAT_BR2:
+                record->target = instruction[1] << 16;
+                break;
+
+            case FORMAT_LS:
+                record->reg1 = lowHalfByte(instruction[0]);
+                record->reg2 = highHalfByte(instruction[1]);
+                record->immediate = lowHalfByte(instruction[1]);
+                break;
+
+            case FORMAT_STACK:
+                record->reg1 = getStackRegister(instruction);
+                break;
+
+            case FORMAT_MOVE:
+                record->reg1 = getMoveRegister(instruction);
+                record->immediate = getImmediate(instruction);
+                break;
+
+            case FORMAT_INTERRUPT:
+                record->immediate = instruction[1];
+                break;
+        }
+    }
+}
+
+//decodeBytes - pulls apart the instruction whose first 4 bytes are given, found at pc, into a
+//DecodedInstruction record. Fields that don't apply to the instruction's format are left at 0.
+static inline void decodeBytes(const unsigned char instruction[4], unsigned int pc, DecodedInstruction *record) {
+    DecodedInstruction decoded = decodeTable[(instruction[0] << 8) | instruction[1]];
+    if(decoded.length == 4) {
+        unsigned int low = (instruction[2] << 8) | instruction[3];
+        if(isaInstructions[decoded.handler].format == FORMAT_BR1) {
+            //BR1 - the 16 bit offset is signed so loops can branch backwards
+            decoded.immediate = (short)low;
+            decoded.target = pc + decoded.immediate;
+        }
+        else {
+            //BR2 - call and jump carry a 24 bit absolute address
+            decoded.target |= low;
+        }
+    }
+    *record = decoded;
+}
+
+#endif
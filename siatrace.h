@@ -0,0 +1,25 @@
+/* SIA Trace Format - the trace file siavm --trace writes and SIATrace reads
+ * A trace is the 4 bytes TRACE_MAGIC, the record size as a host-order word, then one TraceRecord per
+ * instruction run, in the order they ran. Records are in the host's layout, so a trace is read on the
+ * kind of machine that wrote it; a reader checks the record size against its own before using them.
+ */
+
+#ifndef SIATRACE_H
+#define SIATRACE_H
+
+#define TRACE_MAGIC "SIAT"
+#define TRACE_NO_REGISTER 0xFF      //TraceRecord.reg for instructions that write no register
+
+//TraceRecord - one instruction run
+typedef struct TraceRecord {
+    unsigned int pc;
+    unsigned char bytes[4];     //the instruction as it was in memory, 2-byte instructions padded with the next 2
+    unsigned char reg;          //register written, TRACE_NO_REGISTER for none
+    unsigned char wroteMemory;  //1 if address and memoryValue hold a word written to memory
+    unsigned char padding[2];
+    int value;                  //value written to reg
+    unsigned int address;       //memory address written
+    int memoryValue;            //word written there
+} TraceRecord;
+
+#endif
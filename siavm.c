@@ -13,14 +13,66 @@
  * Operational registers OP1, and OP2 are also double buffered between decode and execute. Result is double
  * buffered between execute and store.
  * 
- * Branching instructions branch, call, jump will all invalidate the pipeline when the program counter
- * is updated during the store step, invalidating sequential instructions already in the pipeline. (if the branch
- * is not taken, no invalidation occurs)
+ * Fetch follows the path a branch predictor picks (--predict none, static or 2bit, with a return address
+ * stack). When a branch, call, jump or return is stored somewhere other than where fetch went, the pipeline
+ * is invalidated, squashing the sequential instructions already in it. (if the prediction was right, no
+ * invalidation occurs)
  * 
  * VM implements register forwarding for instructions that depend on output from previous instrucitons.
- * It keeps a history of the last 4 instrucitons and checks it during execution step for dependencies. If 
- * found, the output from the most recent history is used in place, by overwriting the contents of 
- * OP1 and OP2.
+ * A scoreboard holds the last value stored to each register and the cycle it was stored in. During the
+ * execution step any operand stored within the last 4 cycles is taken from the scoreboard, overwriting
+ * the contents of OP1 and OP2.
+ * 
+ * The pipeline counts cycles, instructions, flushes, forwarded operands, load-use stalls and the mix of
+ * instructions run as it goes, with plain increments. --stats prints them at halt, --stats=json as JSON.
+ * --profile counts runs of every PC and basic block and follows calls and returns into a call tree, written
+ * out as collapsed stacks for flamegraph tools. --profile-hz samples the PC from a SIGPROF timer instead.
+ * --trace writes a binary record of every instruction run through a lock-free ring drained by a background
+ * thread. SIATrace prints and diffs the traces. Use: siavm.exe --trace file.trace file.bin
+ * 
+ * Instructions are predecoded once per PC into a DecodedInstruction record (opcodes, registers, immediate,
+ * branch target) that fetch hands down the pipeline in place of the raw bytes. Stores and pushes invalidate
+ * any record whose bytes they overwrite, so self-modifying code is decoded again on its next fetch.
+ * The instruction set is described once in siaisa.h. The records come from a table of every value of an
+ * instruction's first two bytes, and the stages switch on the handler number and its ISA_ flags.
+ * 
+ * --fast skips the pipeline model and runs a direct-threaded functional engine with the same semantics,
+ * for when only the architectural result is needed. Use: siavm.exe --fast file.bin
+ * --jit compiles basic blocks to x86-64 machine code and chains them together, falling back to the
+ * fast engine for everything it doesn't compile. Use: siavm.exe --jit file.bin
+ * 
+ * All VM state lives in a SiaVM struct that every function is handed, so one process can run many VMs.
+ * Errors stop only the VM they happen in. --batch runs a directory of binaries on a pool of threads.
+ * Use: siavm.exe [--fast | --jit] --batch directory [--threads N]
+ * --inputs runs one program over a directory of input images. --lanes runs them in lockstep SIMD lane
+ * groups. Use: siavm.exe --lanes --inputs directory [--input-at address] file.bin
+ * --mem sets the size of memory to any power of two up to 4GB, reserved up front and committed as it is
+ * touched. Addresses are masked to the size of memory. Use: siavm.exe --mem 16M file.bin
+ * --stack sets aside the top of memory for the stack, below a page that is protected from access. Running
+ * into the stack faults on that page instead of being checked before every instruction.
+ * Use: siavm.exe --mem 64K --stack 4K file.bin
+ * Binaries are mapped in rather than read a byte at a time, and may start with a "SIAH" header giving the
+ * load address, entry PC and initial stack pointer. --raw skips the header check. A "SIAF" binary from
+ * assembler --fat (siaformat.h) also carries its block starts and branch targets and every instruction
+ * already decoded, and is mapped in and run without decoding anything first.
+ * --snapshot saves the VM's state and touched memory to a file at interrupt 2, --restore starts from one.
+ * Use: siavm.exe --snapshot warm.snap file.bin, then siavm.exe --restore warm.snap
+ * --fork-server loads a program once, runs it to interrupt 3 under --checkpoint, then forks a copy-on-write
+ * child per input listed in a file, or sent to a Unix socket with --fork-socket.
+ * Use: siavm.exe --fork-server list.txt --checkpoint --input-at 4096 file.bin
+ * Writes into memory mark the pages they touch dirty, saving the page as it was. Interrupt 4 prints only
+ * the bytes that changed, and --repeat resets the VM between runs by copying back just the dirty pages.
+ * What a VM prints goes into a ring buffer drained by a writer thread. The stack pointer is printed as it
+ * moves only under -v, and --output=json prints the dumps as JSON. Use: siavm.exe -v --output=json file.bin
+ * --threaded runs fetch, decode, execute and store at the same time on their own host threads, joined by
+ * lock-free queues, with the same output, statistics and trace as the sequential pipeline.
+ * Use: siavm.exe --threaded --stats --trace file.trace file.bin
+ * --icache and --dcache model set-associative L1 caches on the pipeline's fetch and memory steps, adding
+ * --miss-penalty cycles per miss and reporting hit rates per cache and per PC with the statistics.
+ * Use: siavm.exe --icache 1K,2,16 --dcache 4K,4,32,random file.bin
+ * --sample runs the fast engine for a number of instructions, or to each interrupt 5, then the pipeline model for
+ * an optional warm-up and a window of instructions, over and over, and estimates the whole program's cycles
+ * from the windows' CPI. Use: siavm.exe --sample 1000000,10000,2000 file.bin
  */
 
 
@@ -28,10 +80,24 @@
 //////////////
 // includes //
 //////////////
+#define _GNU_SOURCE     //SEEK_DATA and SEEK_HOLE for sparse snapshots
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include "siaformat.h"
+#include "siatrace.h"
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
 
 
 
@@ -39,54 +105,388 @@
 // Virtual architecture //
 //////////////////////////
 
-//1KB virtual main memory
-unsigned char virtualMemory[1000];
-
-//16 primary registers, 0-15. R15 is the stack pointer
-int registers[16];
-
-//VM internal use
-bool halt; //halt flag
-unsigned int PC; //program counter
-
-//Double buffering added to allow for pipelining. One function can be reading it's input while the previous writes
-//safely to a secondary buffer and vice-versa. bool "ready" flags used to mute buffers during read/write: 1 = ready, 0 = muted.
-//bool "valid" flags used to determine if there is valid in data either buffer to be used. 1 = valid, 0 = not valid.
-//There are also separate instruction buffers to hold the instructions. Each of the primary funcitons
-//loads the buffers into local variables, and then writes those locals to a global for the next step.
-
-//double buffer between fetch and decode
-bool decodeInstructionValid;
-bool decodeBuff1Ready;
-bool decodeBuff2Ready;
-unsigned char decodeInstructionBuffer1[4];
-unsigned char decodeInstructionBuffer2[4];
-
-//double buffer between deocde and execute
-bool executeInstructionValid;
-bool executeBuff1Ready;
-bool executeBuff2Ready;
-unsigned char executeInstructionBuffer1[4];
-unsigned char executeInstructionBuffer2[4];
-int OP1_1;
-int OP1_2;
-int OP2_1;
-int OP2_2;
-
-//double buffer between execute and store
-bool storeInstructionValid;
-bool storeBuff1Ready;
-bool storeBuff2Ready;
-unsigned char storeInstructionBuffer1[4];
-unsigned char storeInstructionBuffer2[4];
-int result1;
-int result2;
-
-//historic instruction tracking - for register forwarding. History array will contain the register in 0-3, and in 4-7 the value.
-//This creates a rudimentary mapping where resultHistory[n] is the register and resultHistory[n+4] is the value.
-int resultHistoryCursor;
-int resultHistory[8];
+//Predecoded instruction cache. Every instruction is pulled apart into a DecodedInstruction (siaisa.h)
+//the first time it is fetched, and the record is reused by decode, execute and store on every later
+//fetch of the same PC. Stores into virtual memory invalidate any record whose bytes they overwrite.
+
+//Per-PC tables (predecoded instructions, compiled blocks) are split into pages of CODE_PAGE_SIZE
+//PCs, allocated the first time a PC in them is used, so large memories only pay for code that runs.
+#define CODE_PAGE_BITS 12
+#define CODE_PAGE_SIZE (1 << CODE_PAGE_BITS)
+_Static_assert(CODE_PAGE_SIZE == FAT_PAGE_SIZE, "SIAF record pages must be decode table pages");
+
+//Writes into memory are tracked in pages of DIRTY_PAGE_SIZE bytes, small enough that interrupt 4 and
+//resetVM only go over what a program actually wrote.
+#define DIRTY_PAGE_BITS 8
+#define DIRTY_PAGE_SIZE (1 << DIRTY_PAGE_BITS)
+
+//default memory size, the 1000 bytes SIA programs were written against
+#define DEFAULT_MEMORY_SIZE 1000
+
+//lane groups run code in lockstep only below this address
+#define LANE_CODE_LIMIT 65536
+
+//Register forwarding window. A value stored within this many cycles is still in flight in the pipeline
+//and reaches the instructions that use it by forwarding.
+#define FORWARD_WINDOW 4
+
+//ScoreboardEntry - the last value stored to a register, for register forwarding
+typedef struct ScoreboardEntry {
+    int value;
+    unsigned long long cycle;   //cycle the value was stored in, 0 if never
+    bool fromMemory;            //loaded from memory (load, pop), a use in the next cycle stalls
+} ScoreboardEntry;
+
+//Branch prediction for the pipeline model. Fetch follows the predicted path, and store squashes the
+//pipeline only when an instruction went somewhere else, charging FLUSH_PENALTY cycles for the two
+//instructions thrown away.
+enum {PREDICT_NONE, PREDICT_STATIC, PREDICT_2BIT};
+#define PREDICTOR_SIZE 1024     //2-bit counters and branch target buffer entries, indexed by PC
+#define RETURN_STACK_SIZE 16
+#define FLUSH_PENALTY 2
+
+//TargetBufferEntry - one branch target buffer entry, the last target of a taken branch, call or jump
+typedef struct TargetBufferEntry {
+    unsigned int pc;
+    unsigned int target;
+    bool valid;
+} TargetBufferEntry;
+
+//JIT compiler state, defined with the JIT compiler below
+typedef struct JitState JitState;
+
+//--profile counts, defined with the profiler below
+typedef struct Profile Profile;
+
+//--trace ring buffer, defined with the trace writer below
+typedef struct TraceRing TraceRing;
+
+//--icache and --dcache cache models, defined with the cache simulator below
+typedef struct Cache Cache;
+enum {REPLACE_LRU, REPLACE_RANDOM};
+
+//output ring buffer, defined with the VM output functions below
+typedef struct OutputRing OutputRing;
+
+//--output formats for the register, memory and changed memory dumps
+enum {OUTPUT_TEXT, OUTPUT_JSON};
+
+//SiaVM - everything one virtual machine needs. Every stage function takes the VM it works on, so any
+//number of VMs can run side by side in one process, each on its own thread.
+typedef struct SiaVM {
+    //virtual main memory, memorySize bytes. The mapping is rounded up to a power of two and every
+    //address is masked with memoryMask, so no load, store or fetch can reach outside it. Pages are
+    //only committed by the OS when they are first touched.
+    unsigned char *virtualMemory;
+    unsigned long long memorySize;
+    unsigned int memoryMask;
+    unsigned int stackTop; //where the stack starts, the top of memory
+    unsigned char *stackGuard; //with --stack, the PROT_NONE page between code and data and the stack
+
+    //16 primary registers, 0-15. R15 is the stack pointer
+    int registers[16];
+
+    //VM internal use
+    bool halt; //halt flag
+    unsigned int PC; //program counter
+    int status; //exit status, set to 1 when the VM stops on an error
+    FILE *out; //where interrupts and errors print, stdout unless the batch runner captures it
+    OutputRing *output; //after startOutput, the ring a writer thread drains to out
+    int verbosity; //-v: 1 or more prints the stack pointer every time it moves
+    int outputFormat; //--output: how interrupts 0, 1 and 4 print, OUTPUT_TEXT or OUTPUT_JSON
+
+    //predecoded instruction for each PC, in pages of CODE_PAGE_SIZE records
+    DecodedInstruction **decodePages;
+
+    //a SIAF binary, mapped copy-on-write for as long as the VM lives. Pages of decodePages that lie in it
+    //are its predecoded records, used in place. blocks is its table of block starts and branch targets.
+    unsigned char *image;
+    size_t imageSize;
+    const unsigned char *blocks;
+    unsigned int blockCount;
+
+    //pages of memory written since markClean. dirtySlots has an entry for every page, its place in
+    //dirtyPages plus 1 or 0 while it is clean. cleanCopies holds each dirty page as it was before its
+    //first write, in the same order, and cleanState the rest of the VM as markClean found it.
+    unsigned int *dirtySlots;
+    unsigned int *dirtyPages;
+    unsigned char *cleanCopies;
+    unsigned int dirtyCount;
+    unsigned int dirtyCapacity;
+    struct SiaVM *cleanState;
+
+    //Double buffering added to allow for pipelining. One function can be reading it's input while the previous writes
+    //safely to a secondary buffer and vice-versa. bool "ready" flags used to mute buffers during read/write: 1 = ready, 0 = muted.
+    //bool "valid" flags used to determine if there is valid in data either buffer to be used. 1 = valid, 0 = not valid.
+    //There are also separate instruction buffers to hold the instructions. Each of the primary funcitons
+    //loads the buffers into local variables, and then writes those locals to the VM for the next step.
+
+    //double buffer between fetch and decode
+    bool decodeInstructionValid;
+    bool decodeBuff1Ready;
+    bool decodeBuff2Ready;
+    DecodedInstruction decodeInstructionBuffer1;
+    DecodedInstruction decodeInstructionBuffer2;
+
+    //double buffer between deocde and execute
+    bool executeInstructionValid;
+    bool executeBuff1Ready;
+    bool executeBuff2Ready;
+    DecodedInstruction executeInstructionBuffer1;
+    DecodedInstruction executeInstructionBuffer2;
+    int OP1_1;
+    int OP1_2;
+    int OP2_1;
+    int OP2_2;
+
+    //double buffer between execute and store
+    bool storeInstructionValid;
+    bool storeBuff1Ready;
+    bool storeBuff2Ready;
+    DecodedInstruction storeInstructionBuffer1;
+    DecodedInstruction storeInstructionBuffer2;
+    int result1;
+    int result2;
+
+    //register forwarding - one scoreboard entry per register
+    ScoreboardEntry scoreboard[16];
+
+    //pipeline statistics for --stats, always counted
+    unsigned long long cycle;       //pipeline cycles run, including flush penalties
+    unsigned long long retired;     //instructions through the store step
+    unsigned long long mix[HANDLER_COUNT]; //retired instructions by handler number
+    unsigned long long flushes;     //invalidatePipeline calls, each one a mispredicted instruction
+    unsigned long long forwarded;   //operands taken from the scoreboard
+    unsigned long long stalls;      //load-use hazards, an operand loaded by the instruction just before
+
+    //branch prediction - fetch takes instructions from fetchPC, the predicted path
+    int predictor;                  //PREDICT_NONE, PREDICT_STATIC or PREDICT_2BIT
+    unsigned int fetchPC;
+    unsigned char counters[PREDICTOR_SIZE]; //2-bit saturating counters, taken from 2 up
+    TargetBufferEntry targetBuffer[PREDICTOR_SIZE];
+    unsigned int returnStack[RETURN_STACK_SIZE]; //return addresses of calls fetched, a ring
+    unsigned int returnStackTop;
+    unsigned long long branches;    //branches, calls, jumps and returns through the store step
+    unsigned long long flushesAvoided; //taken branches, calls, jumps and returns fetch got right
+
+    //compiled code, only while running under --jit
+    JitState *jit;
+
+    //counts collected while running under --profile
+    Profile *profile;
+
+    //records of the instructions run, only while running under --trace
+    TraceRing *trace;
+
+    //L1 instruction and data cache models for the pipeline, NULL unless --icache or --dcache is given
+    Cache *icache;
+    Cache *dcache;
+
+    //where interrupt 2 writes a snapshot, NULL to ignore it. The pipeline sets snapshotPending when it
+    //executes the interrupt and writes the snapshot at the end of the cycle.
+    char *snapshotFile;
+    bool snapshotPending;
+
+    //under --checkpoint, interrupt 3 halts the VM and clears this, so the fork server can clone the VM
+    //from that point
+    bool checkpoint;
+
+    //--sample: the fast engine runs sampleSkip instructions, or to the next interrupt 5 under sampleMarker,
+    //then the pipeline model runs sampleWarmup instructions and a window of sampleWindow, over and over.
+    //The pipeline statistics only count what the pipeline ran, the CPI estimate only the windows.
+    unsigned long long sampleSkip;
+    unsigned long long sampleWindow;    //0 when not sampling
+    unsigned long long sampleWarmup;
+    bool sampleMarker;
+    bool markerReached;                 //the fast engine stopped at interrupt 5
+    unsigned long long fastForwarded;   //instructions run on the fast engine between windows
+    unsigned long long windows;
+    unsigned long long sampledCycles;   //cycles and instructions in the windows
+    unsigned long long sampledInstructions;
+    double minWindowCPI;
+    double maxWindowCPI;
+
+    //while running as one lane of a lane group, the group's map of PCs whose instruction bytes may
+    //differ between lanes. Writes into memory mark the PCs they touch.
+    unsigned char *divergentCode;
+} SiaVM;
+
+
+
+
+///////////////
+// VM Output //
+///////////////
+// Everything a VM prints while it runs goes through vmPrint and vmWrite. Normally that is a buffered
+// write to the VM's out, but after startOutput the text is copied into a large ring instead, with one
+// producer, the VM, and one consumer, a writer thread that drains the ring to out in large writes, so
+// the VM never waits on the console. Chatter like the stack pointer print sits behind -v.
+
+#include <stdarg.h>
+#include <pthread.h>
+
+#define OUTPUT_RING_SIZE (1 << 20)  //bytes, a power of two
+
+//RingDrain - the consumer side of a ring with one producer, the VM, and one consumer, a drain thread that
+//writes the ring's items to out. The output ring and the trace ring each start with one.
+typedef struct RingDrain {
+    unsigned long long head;    //items written by the VM, only the VM stores it
+    unsigned long long tail;    //items written to out, only the drain thread stores it
+    bool done;                  //the VM has finished, drain what is left and stop
+    bool flush;                 //flush out whenever the drain thread catches up
+    FILE *out;
+    pthread_t thread;
+    char *items;
+    size_t itemSize;
+    unsigned long long size;    //items, a power of two
+} RingDrain;
+
+struct OutputRing {
+    RingDrain drain;
+    char bytes[OUTPUT_RING_SIZE];
+};
+
+//drainRing - drain thread body, writes items out of the ring until the VM is done and the ring is empty
+void *drainRing(void *argument) {
+    RingDrain *drain = argument;
+    while(1) {
+        unsigned long long head = __atomic_load_n(&drain->head, __ATOMIC_ACQUIRE);
+        unsigned long long tail = drain->tail;
+        if(head == tail) {
+            if(__atomic_load_n(&drain->done, __ATOMIC_ACQUIRE) && __atomic_load_n(&drain->head, __ATOMIC_ACQUIRE) == tail) {
+                return NULL;
+            }
+            //caught up, let what has been written show before waiting for more
+            if(drain->flush) {
+                fflush(drain->out);
+            }
+            usleep(100);
+            continue;
+        }
+        //write up to the end of the ring in one go, the wrapped part on the next pass
+        unsigned long long start = tail & (drain->size - 1);
+        unsigned long long count = head - tail;
+        if(start + count > drain->size) {
+            count = drain->size - start;
+        }
+        fwrite(drain->items + start * drain->itemSize, drain->itemSize, count, drain->out);
+        __atomic_store_n(&drain->tail, tail + count, __ATOMIC_RELEASE);
+    }
+}
+
+//startDrain - sets up drain for a ring of size items of itemSize bytes and starts its thread, returns 0 if
+//the thread can't be started
+bool startDrain(RingDrain *drain, void *items, size_t itemSize, unsigned long long size, FILE *out, bool flush) {
+    drain->head = 0;
+    drain->tail = 0;
+    drain->done = 0;
+    drain->flush = flush;
+    drain->out = out;
+    drain->items = items;
+    drain->itemSize = itemSize;
+    drain->size = size;
+    return pthread_create(&drain->thread, NULL, drainRing, drain) == 0;
+}
+
+//stopDrain - tells drain's thread the VM is done and waits for it to write everything out
+void stopDrain(RingDrain *drain) {
+    __atomic_store_n(&drain->done, 1, __ATOMIC_RELEASE);
+    pthread_join(drain->thread, NULL);
+}
+
+//startOutput - starts a writer thread for vm's output. If it can't, the VM keeps writing to out itself.
+void startOutput(SiaVM *vm) {
+    OutputRing *ring = malloc(sizeof(OutputRing));
+    if(ring == NULL) {
+        return;
+    }
+    if(!startDrain(&ring->drain, ring->bytes, 1, OUTPUT_RING_SIZE, vm->out, 1)) {
+        free(ring);
+        return;
+    }
+    vm->output = ring;
+}
+
+//stopOutput - waits for the writer thread to write everything out, after which the VM writes to out itself
+void stopOutput(SiaVM *vm) {
+    OutputRing *ring = vm->output;
+    if(ring == NULL) {
+        return;
+    }
+    stopDrain(&ring->drain);
+    fflush(ring->drain.out);
+    free(ring);
+    vm->output = NULL;
+}
+
+//vmWrite - prints length bytes of text from the VM
+void vmWrite(SiaVM *vm, const char *text, size_t length) {
+    OutputRing *ring = vm->output;
+    if(ring == NULL) {
+        fwrite(text, 1, length, vm->out);
+        return;
+    }
+    unsigned long long head = ring->drain.head;
+    while(length > 0) {
+        //the ring is full, wait for the writer thread to catch up
+        unsigned long long space;
+        while((space = OUTPUT_RING_SIZE - (head - __atomic_load_n(&ring->drain.tail, __ATOMIC_ACQUIRE))) == 0) {
+            usleep(10);
+        }
+        //copy up to the end of the ring or the free space, whichever is first
+        unsigned long long start = head & (OUTPUT_RING_SIZE - 1);
+        unsigned long long count = (length < space) ? length : space;
+        if(start + count > OUTPUT_RING_SIZE) {
+            count = OUTPUT_RING_SIZE - start;
+        }
+        memcpy(&ring->bytes[start], text, count);
+        head += count;
+        text += count;
+        length -= count;
+        __atomic_store_n(&ring->drain.head, head, __ATOMIC_RELEASE);
+    }
+}
 
+//vmPrintLine - prints value as a line of its own, without going through printf
+void vmPrintLine(SiaVM *vm, int value) {
+    char text[16];
+    char *start = text + sizeof(text);
+    *--start = '\n';
+    unsigned int magnitude = (value < 0) ? 0u - (unsigned int)value : (unsigned int)value;
+    do {
+        *--start = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while(magnitude != 0);
+    if(value < 0) {
+        *--start = '-';
+    }
+    vmWrite(vm, start, text + sizeof(text) - start);
+}
+
+//vmPrint - printf for the VM
+void vmPrint(SiaVM *vm, const char *format, ...) {
+    char line[256];
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+    if(length < 0) {
+        return;
+    }
+    if((size_t)length < sizeof(line)) {
+        vmWrite(vm, line, length);
+        return;
+    }
+    //too long for the line buffer, format it again into one that fits
+    char *text = malloc(length + 1);
+    if(text != NULL) {
+        va_start(arguments, format);
+        vsnprintf(text, length + 1, format, arguments);
+        va_end(arguments);
+        vmWrite(vm, text, length);
+        free(text);
+    }
+}
 
 
 
@@ -94,142 +494,623 @@ int resultHistory[8];
 // Helper functions //
 //////////////////////
 
-//historyCheck checks the last 4 results to see if a register being executed on was changed
-//recently enough to break continuity. If so, forward the result from that previous execution to the current one.
-//In order to eschew a method to check if historyCheck found the register, value is passed as input and returned changed or not.
-int historyCheck(int reg, int value) {//vscode throws errors when naming parameter "register" is this a reserved word in c?
-    int cursor = resultHistoryCursor;
-    //check the history from oldest to newest looking for changes to specified register
-    for(int i = 0; i < 4; i++) {
-        if(resultHistory[cursor] == reg) {
-            value = resultHistory[cursor + 4];
+//scoreboardCheck - returns the value of reg for the instruction in the execution step. If it was stored
+//within the forwarding window, it is forwarded from the scoreboard and the hazard is counted.
+int scoreboardCheck(SiaVM *vm, int reg) {
+    ScoreboardEntry *entry = &vm->scoreboard[reg];
+    if(entry->cycle == 0 || entry->cycle + FORWARD_WINDOW <= vm->cycle) {
+        return vm->registers[reg];
+    }
+    vm->forwarded++;
+    if(entry->fromMemory && entry->cycle + 1 == vm->cycle) {
+        vm->stalls++;
+    }
+    return entry->value;
+}
+
+//scoreboardLog - records each register update made by the store step for scoreboardCheck() and forwarding.
+void scoreboardLog(SiaVM *vm, int reg, int value, bool fromMemory) {
+    ScoreboardEntry *entry = &vm->scoreboard[reg];
+    entry->value = value;
+    entry->cycle = vm->cycle;
+    entry->fromMemory = fromMemory;
+}
+
+//move the stack pointer up or down, roll over if out of bounds, printing where it moved to under -v. Like every other address the stack
+//pointer is unsigned, so it can reach the top of memories over 2GB.
+//With a guard page the stack can't run out of its region without faulting, so it isn't wrapped.
+void moveStackPointer(SiaVM *vm, int offset) {
+    if(vm->stackGuard != NULL) {
+        vm->registers[15] += offset;
+        if(vm->verbosity > 0) {
+            vmPrintLine(vm, vm->registers[15]);
+        }
+        return;
+    }
+    long long pointer = (long long)(unsigned int)vm->registers[15] + offset;
+    if(pointer > vm->stackTop) {
+        pointer -= vm->stackTop;
+    }
+    if(pointer < 0) {
+        pointer += vm->stackTop;
+    }
+    vm->registers[15] = (int)(unsigned int)pointer;
+    if(vm->verbosity > 0) {
+        vmPrintLine(vm, vm->registers[15]);
+    }
+}
+
+//inImage - whether pointer lies in the VM's SIAF binary
+bool inImage(SiaVM *vm, const void *pointer) {
+    return vm->image != NULL && (const unsigned char *)pointer >= vm->image
+        && (const unsigned char *)pointer < vm->image + vm->imageSize;
+}
+
+//attachFatRecords, invalidateDecoded - defined with the decode table below
+void attachFatRecords(SiaVM *vm, FatHeader *header);
+void invalidateDecoded(SiaVM *vm, unsigned int loc);
+
+//loadFile - loads a binary into virtual memory, taking the load address, entry PC and stack pointer from
+//its header unless raw is set. Returns the address just past the program, or -1 if the file can't be
+//opened or doesn't fit in memory.
+//The file is mapped rather than read. Headerless binaries of a page or more are mapped copy-on-write
+//straight over the bottom of memory, as is the code of a SIAF binary when it starts on a page. Anything
+//else is copied in with one memcpy. Headerless binaries still get the end of file byte (0xFF) the original
+//loader stored after the program, and so does a SIAF binary's code, so --fat doesn't change what the
+//program sees in memory. A SIAF binary stays mapped, and its predecoded records and block table are used
+//in place.
+long long loadFile(SiaVM *vm, char *filename, bool raw) {
+    int file = open(filename, O_RDONLY);
+    struct stat info;
+    if(file < 0 || fstat(file, &info) != 0) {
+        vmPrint(vm, "unable to open input file\n");
+        if(file >= 0) {
+            close(file);
         }
-        cursor++;
-        //check to make sure cursor stays within the 0-3 range
-        if(cursor >= 4) {
-            cursor =- 4;
+        return -1;
+    }
+    unsigned long long size = info.st_size;
+    unsigned char *bytes = NULL;
+    if(size > 0) {
+        bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+        if(bytes == MAP_FAILED) {
+            vmPrint(vm, "unable to map input file\n");
+            close(file);
+            return -1;
+        }
+    }
+
+    unsigned long long address = 0;
+    unsigned long long offset = 0;
+    unsigned int entry = 0;
+    unsigned int stackPointer = 0;
+    unsigned long long length = size;
+    FatHeader fat;
+    bool isFat = 0;
+    if(!raw && size >= HEADER_SIZE && bigEndianWord(bytes) == HEADER_MAGIC) {
+        address = bigEndianWord(bytes + 4);
+        entry = bigEndianWord(bytes + 8);
+        stackPointer = bigEndianWord(bytes + 12);
+        offset = HEADER_SIZE;
+        length = size - offset;
+    }
+    else if(!raw && size >= FAT_HEADER_SIZE && bigEndianWord(bytes) == FAT_MAGIC) {
+        if(!readFatHeader(bytes, size, &fat)) {
+            vmPrint(vm, "bad SIAF header\n");
+            munmap(bytes, size);
+            close(file);
+            return -1;
+        }
+        address = fat.address;
+        entry = fat.entry;
+        stackPointer = fat.stackPointer;
+        offset = fat.codeOffset;
+        length = fat.codeLength;
+        isFat = 1;
+    }
+
+    long long loaded = -1;
+    if(address + length > vm->memorySize || entry >= vm->memorySize || stackPointer > vm->stackTop) {
+        vmPrint(vm, "program does not fit in memory\n");
+    }
+    else {
+        long pageSize = sysconf(_SC_PAGESIZE);
+        bool mapped = offset % pageSize == 0 && address % pageSize == 0 && offset + length == size
+            && length >= (unsigned long long)pageSize
+            && mmap(vm->virtualMemory + address, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file, offset) != MAP_FAILED;
+        if(!mapped && length > 0) {
+            memcpy(vm->virtualMemory + address, bytes + offset, length);
+        }
+        if((offset == 0 || isFat) && address + length < vm->memorySize) {
+            vm->virtualMemory[address + length] = 0xFF;
+        }
+        vm->PC = entry;
+        if(stackPointer != 0) {
+            vm->registers[15] = (int)stackPointer;
+        }
+        loaded = address + length;
+        if(isFat) {
+            vm->image = bytes;
+            vm->imageSize = size;
+            vm->blocks = bytes + fat.blockOffset;
+            vm->blockCount = fat.blockCount;
+            attachFatRecords(vm, &fat);
+            bytes = NULL;
         }
     }
-    return value;
+
+    if(bytes != NULL) {
+        munmap(bytes, size);
+    }
+    close(file);
+    return loaded;
+}
+
+//readInput - reads an input image from in into virtual memory at address until end of file, returns
+//the address just past the image
+long long readInput(SiaVM *vm, FILE *in, unsigned int address) {
+    long long end = address;
+    if(address < vm->memorySize) {
+        end += fread(vm->virtualMemory + address, 1, vm->memorySize - address, in);
+    }
+    //an input read over a SIAF binary's code replaces instructions its records already hold
+    for(long long loc = address; vm->image != NULL && loc < end; loc += 4) {
+        invalidateDecoded(vm, (unsigned int)loc);
+    }
+    return end;
+}
+
+//loadInput - loads an input image into virtual memory at address, returns the address just past the
+//image or -1 if it can't be opened
+long long loadInput(SiaVM *vm, char *filename, unsigned int address) {
+    FILE *in = fopen(filename, "rb");
+    if(in == NULL) {
+        vmPrint(vm, "unable to open input file\n");
+        return -1;
+    }
+    long long end = readInput(vm, in, address);
+    fclose(in);
+    return end;
+}
+
+//invalidatePipeline - invalidates instructions in pipeline when program counter jumps
+void invalidatePipeline(SiaVM *vm) {
+    vm->flushes++;
+    vm->decodeInstructionValid = 0;
+    vm->executeInstructionValid = 0;
+    vm->storeInstructionValid = 0;
 }
 
-//historyLog logs the result each time a register is updated for use with historyCheck() and forwarding.
-void historyLog(int reg, int value) {
-    resultHistoryCursor++;
-    //check to make sure cursor stays within the 0-3 range
-    if(resultHistoryCursor >= 4) {
-        resultHistoryCursor =- 4;
+//predecodeInstruction - pulls apart the instruction at pc into a DecodedInstruction record.
+//Fields that don't apply to the instruction's format are left at 0.
+void predecodeInstruction(SiaVM *vm, unsigned int pc, DecodedInstruction *record) {
+    unsigned char instruction[4];
+    for (int i = 0; i < 4; i++) {
+        instruction[i] = vm->virtualMemory[(pc + i) & vm->memoryMask];
     }
 
-    //store history log
-    resultHistory[resultHistoryCursor] = reg;
-    resultHistory[resultHistoryCursor + 4] = value;
+    decodeBytes(instruction, pc, record);
+}
+
+//codePageRecords - how many records a page of a per-PC table holds, less than a full page when all of
+//memory fits in one
+unsigned int codePageRecords(SiaVM *vm) {
+    return (vm->memoryMask < CODE_PAGE_SIZE) ? vm->memoryMask + 1 : CODE_PAGE_SIZE;
+}
+
+//codePageCount - how many pages a per-PC table needs to cover memory
+unsigned int codePageCount(SiaVM *vm) {
+    return (vm->memoryMask >> CODE_PAGE_BITS) + 1;
+}
+
+//decodePage - allocates the page of decoded instructions holding pc
+DecodedInstruction *decodePage(SiaVM *vm, unsigned int pc) {
+    DecodedInstruction *page = calloc(codePageRecords(vm), sizeof(DecodedInstruction));
+    if(page == NULL) {
+        fprintf(stderr, "Error! Out of memory for decoded instructions\n");
+        exit(1);
+    }
+    vm->decodePages[pc >> CODE_PAGE_BITS] = page;
+    return page;
 }
 
-//highHalfByte - returns the high 4 bits from a given byte
-//shifted to the low 4 bits of the resultant byte
-char highHalfByte(unsigned char byte) {
-    return (byte & 240) >> 4;
+//fetchDecoded - returns the cached record for the instruction at pc, decoding it on first use
+DecodedInstruction *fetchDecoded(SiaVM *vm, unsigned int pc) {
+    pc &= vm->memoryMask;
+    DecodedInstruction *page = vm->decodePages[pc >> CODE_PAGE_BITS];
+    if(page == NULL) {
+        page = decodePage(vm, pc);
+    }
+    DecodedInstruction *record = &page[pc & (CODE_PAGE_SIZE - 1)];
+    if(!record->valid) {
+        predecodeInstruction(vm, pc, record);
+    }
+    return record;
 }
 
-//lowHalfByte - returns the low 4 bits of a given byte
-//with the high 4 bits masked out
-char lowHalfByte(unsigned char byte) {
-    return (byte & 15);
+//invalidateDecoded - called for every 4-byte write into virtual memory at loc. Any instruction
+//starting up to 3 bytes before loc may have had its bytes overwritten, so its record is dropped
+//and decoded again the next time it is fetched.
+void invalidateDecoded(SiaVM *vm, unsigned int loc) {
+    for(unsigned int i = 0; i < 7; i++) {
+        unsigned int pc = (loc - 3 + i) & vm->memoryMask;
+        DecodedInstruction *page = vm->decodePages[pc >> CODE_PAGE_BITS];
+        if(page != NULL) {
+            page[pc & (CODE_PAGE_SIZE - 1)].valid = 0;
+        }
+    }
 }
 
-//get3R - helper functions for decoding 3R instructions
-//get the first register from 3R instructions
-unsigned char get3R1(unsigned char instruction[4]) {
-    return lowHalfByte(instruction[0]);
+//attachFatRecords - points the decode table at the pages of a SIAF binary's predecoded records, so the
+//program starts without decoding anything. The records are used only if they were written in this
+//host's layout and every valid one holds a handler and registers the engines can index with, otherwise
+//the code is decoded as it is fetched like any other binary's.
+void attachFatRecords(SiaVM *vm, FatHeader *header) {
+    if(header->byteOrder != FAT_BYTE_ORDER || header->recordSize != sizeof(DecodedInstruction)
+            || header->recordStart % CODE_PAGE_SIZE != 0 || header->recordCount % CODE_PAGE_SIZE != 0
+            || header->recordOffset % _Alignof(DecodedInstruction) != 0
+            || (unsigned long long)header->recordOffset + (unsigned long long)header->recordCount * header->recordSize > vm->imageSize) {
+        return;
+    }
+    DecodedInstruction *records = (DecodedInstruction *)(vm->image + header->recordOffset);
+    for(unsigned int i = 0; i < header->recordCount; i++) {
+        unsigned char valid = *(unsigned char *)&records[i].valid;
+        if(valid > 1 || (valid && (records[i].handler >= HANDLER_COUNT || (records[i].length != 2 && records[i].length != 4)
+                || records[i].reg1 > 15 || records[i].reg2 > 15 || records[i].reg3 > 15))) {
+            return;
+        }
+    }
+    for(unsigned int i = 0; i < header->recordCount / CODE_PAGE_SIZE; i++) {
+        unsigned long long page = (header->recordStart >> CODE_PAGE_BITS) + (unsigned long long)i;
+        if(page >= codePageCount(vm)) {
+            break;
+        }
+        if(!inImage(vm, vm->decodePages[page])) {
+            free(vm->decodePages[page]);
+        }
+        vm->decodePages[page] = records + (size_t)i * CODE_PAGE_SIZE;
+    }
 }
 
-//get the second register from 3R instrucitons
-unsigned char get3R2(unsigned char instruction[4]) {
-    return highHalfByte(instruction[1]);
+//readWord - reads the 4 bytes at loc in virtual memory as one 32-bit big endian value
+int readWord(SiaVM *vm, unsigned int loc) {
+    unsigned char *memory = vm->virtualMemory;
+    unsigned int mask = vm->memoryMask;
+    return (memory[loc & mask] << 24) | (memory[(loc + 1) & mask] << 16) | (memory[(loc + 2) & mask] << 8) | (memory[(loc + 3) & mask]);
 }
 
-//get the third register from 3R instructions
-unsigned char get3R3(unsigned char instruction[4]) {
-    return lowHalfByte(instruction[1]);
+//jitInvalidate, jitRelease - defined with the JIT compiler below
+void jitInvalidate(SiaVM *vm, unsigned int loc);
+void jitRelease(SiaVM *vm);
+
+//dirtyPageCount - how many DIRTY_PAGE_SIZE pages cover memory
+unsigned int dirtyPageCount(SiaVM *vm) {
+    return ((unsigned long long)vm->memoryMask + 1) >> DIRTY_PAGE_BITS;
 }
 
-//getBR - helper functions for decoding br1 instructions 
-//get the first register from BR1 instructions
-unsigned char getBR1(unsigned char instruction[4]) {
-    return highHalfByte(instruction[1]);
+//markDirty - called before every write into the page holding loc. The first write since markClean saves
+//a copy of the page as it was.
+void markDirty(SiaVM *vm, unsigned int loc) {
+    unsigned int page = (loc & vm->memoryMask) >> DIRTY_PAGE_BITS;
+    if(vm->dirtySlots[page] != 0) {
+        return;
+    }
+    if(vm->dirtyCount == vm->dirtyCapacity) {
+        unsigned int capacity = vm->dirtyCapacity ? vm->dirtyCapacity * 2 : 16;
+        unsigned int *pages = realloc(vm->dirtyPages, capacity * sizeof(unsigned int));
+        vm->dirtyPages = (pages != NULL) ? pages : vm->dirtyPages;
+        unsigned char *copies = realloc(vm->cleanCopies, (size_t)capacity * DIRTY_PAGE_SIZE);
+        vm->cleanCopies = (copies != NULL) ? copies : vm->cleanCopies;
+        if(pages == NULL || copies == NULL) {
+            fprintf(stderr, "Error! Out of memory for dirty pages\n");
+            exit(1);
+        }
+        vm->dirtyCapacity = capacity;
+    }
+    memcpy(vm->cleanCopies + (size_t)vm->dirtyCount * DIRTY_PAGE_SIZE,
+        vm->virtualMemory + ((size_t)page << DIRTY_PAGE_BITS), DIRTY_PAGE_SIZE);
+    vm->dirtyPages[vm->dirtyCount++] = page;
+    vm->dirtySlots[page] = vm->dirtyCount;
 }
 
-//get the second register from BR1 instrucitons
-//NOTE: not for BR2 instructions.
-unsigned char getBR2(unsigned char instruction[4]) {
-    return lowHalfByte(instruction[1]);
+//markClean - makes memory and the VM as they are now what interrupt 4 compares against and resetVM
+//goes back to. Returns 0 if there is no memory to keep the VM's state in.
+bool markClean(SiaVM *vm) {
+    for(unsigned int i = 0; i < vm->dirtyCount; i++) {
+        vm->dirtySlots[vm->dirtyPages[i]] = 0;
+    }
+    vm->dirtyCount = 0;
+    if(vm->cleanState == NULL) {
+        vm->cleanState = malloc(sizeof(SiaVM));
+    }
+    if(vm->cleanState != NULL) {
+        *vm->cleanState = *vm;
+    }
+    return vm->cleanState != NULL;
 }
 
-//getStackRegister - get register from stack instrucitons
-unsigned char getStackRegister(unsigned char instruction[4]) {
-    return lowHalfByte(instruction[0]);
+//resetVM - puts the VM back the way markClean left it, copying back only the pages written since.
+//Returns 0 if markClean was never called.
+bool resetVM(SiaVM *vm) {
+    if(vm->cleanState == NULL) {
+        return 0;
+    }
+    for(unsigned int i = 0; i < vm->dirtyCount; i++) {
+        unsigned int page = vm->dirtyPages[i];
+        memcpy(vm->virtualMemory + ((size_t)page << DIRTY_PAGE_BITS),
+            vm->cleanCopies + (size_t)i * DIRTY_PAGE_SIZE, DIRTY_PAGE_SIZE);
+        for(unsigned int loc = page << DIRTY_PAGE_BITS; loc < (page << DIRTY_PAGE_BITS) + DIRTY_PAGE_SIZE; loc += 4) {
+            invalidateDecoded(vm, loc);
+        }
+        vm->dirtySlots[page] = 0;
+    }
+
+    //registers, PC, pipeline, predictor and counts come back from the clean copy, the tables that have
+    //grown since and anything attached to the VM stay
+    SiaVM current = *vm;
+    *vm = *current.cleanState;
+    vm->out = current.out;
+    vm->output = current.output;
+    vm->dirtyPages = current.dirtyPages;
+    vm->cleanCopies = current.cleanCopies;
+    vm->dirtyCount = 0;
+    vm->dirtyCapacity = current.dirtyCapacity;
+    vm->jit = current.jit;
+    vm->profile = current.profile;
+    vm->trace = current.trace;
+    vm->icache = current.icache;
+    vm->dcache = current.dcache;
+    return 1;
 }
 
-//get register from move instructions
-unsigned char getMoveRegister(unsigned char instruction[4]) {
-    return lowHalfByte(instruction[0]);
+//writeWord - splits a 32-bit value into 4 octets and stores them big endian at loc in virtual memory.
+//Every write into memory goes through here so predecoded and compiled instructions it overwrites are dropped,
+//and the pages it writes are marked dirty.
+void writeWord(SiaVM *vm, unsigned int loc, int value) {
+    unsigned int mask = vm->memoryMask;
+    if(vm->dirtySlots[(loc & mask) >> DIRTY_PAGE_BITS] == 0 || vm->dirtySlots[((loc + 3) & mask) >> DIRTY_PAGE_BITS] == 0) {
+        markDirty(vm, loc);
+        markDirty(vm, loc + 3);
+    }
+    vm->virtualMemory[loc & mask] = value >> 24;
+    vm->virtualMemory[(loc + 1) & mask] = value >> 16;
+    vm->virtualMemory[(loc + 2) & mask] = value >> 8;
+    vm->virtualMemory[(loc + 3) & mask] = value;
+    invalidateDecoded(vm, loc);
+    jitInvalidate(vm, loc);
+    if(vm->divergentCode != NULL) {
+        for(unsigned int i = 0; i < 7; i++) {
+            unsigned int pc = (loc - 3 + i) & mask;
+            if(pc < LANE_CODE_LIMIT) {
+                vm->divergentCode[pc] = 1;
+            }
+        }
+    }
 }
 
-//move the stack pointer up or down, roll over if out of bounds
-void moveStackPointer(int offset) {
-    registers[15] += offset;
-    if(registers[15] > 1000) {
-        registers[15] -= 1000;
+//dumpRegisters - interrupt 0, prints the 16 register values given, under --output=json as one JSON object
+void dumpRegisters(SiaVM *vm, int values[16]) {
+    char text[512];
+    char *next = text;
+    if(vm->outputFormat == OUTPUT_JSON) {
+        next += sprintf(next, "{\"registers\": [");
+        for(int i = 0; i < 16; i++) {
+            next += sprintf(next, (i < 15) ? "%d, " : "%d]}\n", values[i]);
+        }
     }
-    if(registers[15] < 0) {
-        registers[15] += 1000;
+    else {
+        next += sprintf(next, "Register contents: \n");
+        for(int i = 0; i < 16; i++) {
+            next += sprintf(next, "Reg[%-2d]: %d\n", i, values[i]);
+        }
+    }
+    vmWrite(vm, text, next - text);
+}
+
+//hexDigits - writes byte as two hex digits at text, returns where the next byte goes
+char *hexDigits(char *text, unsigned char byte) {
+    static const char digits[16] = "0123456789ABCDEF";
+    text[0] = digits[byte >> 4];
+    text[1] = digits[byte & 15];
+    return text + 2;
+}
+
+//zeroBytes - whether the length bytes at bytes are all zero
+bool zeroBytes(const unsigned char *bytes, size_t length) {
+    return length == 0 || (bytes[0] == 0 && memcmp(bytes, bytes + 1, length - 1) == 0);
+}
+
+//touchedPages - one byte per host page of memory, 1 if the page holds anything but zeros. The guard page
+//can't be read and counts as untouched. Pages the program never wrote read as zero. Which pages are resident says nothing about which
+//were written: a written page may be swapped out, and a page of a mapped file evicted. NULL if out of memory.
+unsigned char *touchedPages(SiaVM *vm, unsigned long long pageSize) {
+    unsigned long long mapping = (unsigned long long)vm->memoryMask + 1;
+    unsigned long long pages = (mapping + pageSize - 1) / pageSize;
+    unsigned char *touched = malloc(pages);
+    for(unsigned long long page = 0; touched != NULL && page < pages; page++) {
+        unsigned char *bytes = vm->virtualMemory + page * pageSize;
+        unsigned long long length = (mapping - page * pageSize < pageSize) ? mapping - page * pageSize : pageSize;
+        touched[page] = bytes != vm->stackGuard && !zeroBytes(bytes, length);
     }
-    printf("%d\n", registers[15]);
+    return touched;
 }
 
-//getImmediate - get the immediate value from move instructions,
-//and convert to signed.
-signed char getImmediate(unsigned char instruction[4]) {
-    signed char signedByte = instruction[1];
+//dumpMemory - interrupt 1, prints memory contents arrayed 20 bytes per line. Memories over DUMP_ALL_LIMIT
+//leave out the lines in pages that are all zero, as every page the program never touched is. Each line is put together
+//in a buffer and written at once. Under --output=json memory is one JSON object, a list of the runs of
+//lines that were printed, each an address and its bytes as a hex string.
+#define DUMP_ALL_LIMIT 65536
+void dumpMemory(SiaVM *vm) {
+    //which pages hold anything but zeros, one byte per page
+    unsigned long long pageSize = sysconf(_SC_PAGESIZE);
+    unsigned char *touched = NULL;
+    if(vm->memorySize > DUMP_ALL_LIMIT) {
+        touched = touchedPages(vm, pageSize);
+    }
 
-    //conversion - is this actually necessary?
-    if((signedByte >> 7) == 1) {
-        signedByte -= 1;
-        signedByte = ~signedByte;
+    bool json = vm->outputFormat == OUTPUT_JSON;
+    if(json) {
+        vmPrint(vm, "{\"memory\": [");
+    }
+    else {
+        vmPrint(vm, "Memory contents: \n=================================================================\n");
+    }
+    unsigned long long runEnd = 0;
+    bool inRun = 0;
+    for(unsigned long long line = 0; line < vm->memorySize; ) {
+        unsigned int length = (vm->memorySize - line < 20) ? vm->memorySize - line : 20;
+        if(touched != NULL && !(touched[line / pageSize] & 1) && !(touched[(line + length - 1) / pageSize] & 1)) {
+            //skip to the first line that reaches into the next page
+            unsigned long long next = ((line + length - 1) / pageSize + 1) * pageSize / 20 * 20;
+            line = (next > line) ? next : line + 20;
+            continue;
+        }
+        //the guard page can't be read, its bytes print as --
+        unsigned char *bytes = vm->virtualMemory + line;
+        if(vm->stackGuard != NULL && bytes >= vm->stackGuard && bytes + length <= vm->stackGuard + pageSize) {
+            line += 20;
+            continue;
+        }
+        char text[20 * 3 + 48];
+        char *next = text;
+        //a line that doesn't follow on from the last one starts a new run
+        if(json && (!inRun || line != runEnd)) {
+            next += sprintf(next, "%s{\"address\": %llu, \"bytes\": \"", inRun ? "\"}, " : "", line);
+            inRun = 1;
+        }
+        for(unsigned int i = 0; i < length; i++) {
+            if(vm->stackGuard != NULL && bytes + i >= vm->stackGuard && bytes + i < vm->stackGuard + pageSize) {
+                memcpy(next, "--", 2);
+                next += 2;
+            }
+            else {
+                next = hexDigits(next, bytes[i]);
+            }
+            if(!json) {
+                *next++ = ' ';
+            }
+        }
+        //every 20 bytes print line number (bytes) and newline
+        if(!json) {
+            next += sprintf(next, " %0 4lld\n", line);
+        }
+        vmWrite(vm, text, next - text);
+        runEnd = line + length;
+        line += 20;
     }
+    if(json) {
+        vmPrint(vm, "%s]}\n", inRun ? "\"}" : "");
+    }
+    else {
+        vmPrint(vm, "=================================================================\n");
+    }
+    free(touched);
+}
 
-    return signedByte;
+//compareUnsigned - qsort order for unsigned ints
+int compareUnsigned(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
 }
 
-//loadfile - function loads binary file of SIA instructions from disk
-void loadFile(char *filename) {
-    FILE *in = fopen(filename,"r");
-    if (in == NULL) { 
-        printf("unable to open input file\n");
-        exit(1); 
+//dumpChanges - interrupt 4, prints only the bytes that differ from memory at markClean, or as loaded.
+//Each run of changed bytes is printed as its address followed by up to 20 bytes a line, or under
+//--output=json as one JSON object listing the runs. Only the pages written since are compared.
+void dumpChanges(SiaVM *vm) {
+    unsigned int *pages = malloc((vm->dirtyCount + 1) * sizeof(unsigned int));
+    if(pages == NULL) {
+        return;
     }
+    memcpy(pages, vm->dirtyPages, vm->dirtyCount * sizeof(unsigned int));
+    qsort(pages, vm->dirtyCount, sizeof(unsigned int), compareUnsigned);
 
-    //while the end of file has not been encountered, take one character
-    //at a time storing in virtual memory.
-    char c;
-    int cursor = 0;
-    while(!feof(in)) {
-        c = fgetc(in);
-        virtualMemory[cursor] = c;
-        cursor++;
+    bool json = vm->outputFormat == OUTPUT_JSON;
+    if(json) {
+        vmPrint(vm, "{\"changes\": [");
     }
-    fclose(in);
+    else {
+        vmPrint(vm, "Changed memory: \n=================================================================\n");
+    }
+    char text[48 + 20 * 3 + 2];
+    char *next = text;
+    unsigned long long runEnd = 0;
+    unsigned int runs = 0;
+    unsigned int inLine = 0;
+    for(unsigned int i = 0; i < vm->dirtyCount; i++) {
+        unsigned long long start = (unsigned long long)pages[i] << DIRTY_PAGE_BITS;
+        unsigned char *now = vm->virtualMemory + start;
+        unsigned char *before = vm->cleanCopies + (size_t)(vm->dirtySlots[pages[i]] - 1) * DIRTY_PAGE_SIZE;
+        for(unsigned int b = 0; b < DIRTY_PAGE_SIZE && start + b < vm->memorySize; b++) {
+            if(now[b] == before[b]) {
+                continue;
+            }
+            //a full line or a gap ends the line, a run carries on into the next line and the next page
+            unsigned long long address = start + b;
+            bool gap = runs > 0 && address != runEnd;
+            if(inLine == 20 || (inLine > 0 && gap)) {
+                if(!json) {
+                    *next++ = '\n';
+                }
+                vmWrite(vm, text, next - text);
+                next = text;
+                inLine = 0;
+            }
+            if(runs == 0 || gap) {
+                next += json ? sprintf(next, "%s{\"address\": %llu, \"bytes\": \"", runs ? "\"}, " : "", address)
+                    : sprintf(next, "%10llu: ", address);
+                runs++;
+            }
+            else if(inLine == 0 && !json) {
+                next += sprintf(next, "%10llu: ", address);
+            }
+            next = hexDigits(next, now[b]);
+            if(!json) {
+                *next++ = ' ';
+            }
+            runEnd = address + 1;
+            inLine++;
+        }
+    }
+    if(inLine > 0 && !json) {
+        *next++ = '\n';
+    }
+    vmWrite(vm, text, next - text);
+    if(json) {
+        vmPrint(vm, "%s]}\n", runs ? "\"}" : "");
+    }
+    else {
+        vmPrint(vm, "=================================================================\n");
+    }
+    free(pages);
 }
 
-//invalidatePipeline - invalidates instructions in pipeline when program counter jumps
-void invalidatePipeline() {
-    decodeInstructionValid = 0;
-    executeInstructionValid = 0;
-    storeInstructionValid = 0;
+//stackCollision - the program counter has run into the stack, report and stop this VM
+void stackCollision(SiaVM *vm, unsigned int pc) {
+    //instructions and stack may have collided. Fetch may retrieve stack data
+    vmPrint(vm, "Error! Instructions and stack may have collided. Stack ptr: %d, PC: %d\n", vm->registers[15], pc);
+    vm->status = 1;
+    vm->halt = 1;
+}
+
+//illegalInstruction - opcodes 13-15 and stack opcode2 3 are not part of SIA, report and stop this VM
+void illegalInstruction(SiaVM *vm, unsigned char opcode, unsigned char opcode2, unsigned int pc) {
+    vmPrint(vm, "Error! Illegal instruction. Opcode: %d, Opcode2: %d, PC: %d\n", opcode, opcode2, pc);
+    vm->status = 1;
+    vm->halt = 1;
 }
 
+//divideError - a divide by zero, or of INT_MIN by -1, would trap the whole process, report and stop this VM
+void divideError(SiaVM *vm, int dividend, int divisor, unsigned int pc) {
+    vmPrint(vm, "Error! Can't divide %d by %d, PC: %d\n", dividend, divisor, pc);
+    vm->status = 1;
+    vm->halt = 1;
+}
 
+//badDivide - whether dividend / divisor has no int result
+static inline bool badDivide(int dividend, int divisor) {
+    return divisor == 0 || (dividend == INT_MIN && divisor == -1);
+}
 
 
 
@@ -238,548 +1119,3598 @@ void invalidatePipeline() {
 ///////////////////////
 // The primary execution loop repeats these 4 functions: fetch, decode, execute, store. 
 
-//fetch function - fetches the next instruction by fetching the 4 bytes at
-//the location indicated by the program counter. 2-byte instructions ignore 
-//extra 2 bytes fetched. Preforms a check to see if the program counter is
+//traceInstruction - records an instruction that has run for --trace, defined with the trace writer below
+void traceInstruction(SiaVM *vm, unsigned int pc, DecodedInstruction *instruction, unsigned int address);
+
+//writeSnapshot - interrupt 2, writes the VM to its snapshot file, defined with snapshots below
+void writeSnapshot(SiaVM *vm);
+
+//cacheAccess - looks up the lines an access touches in a cache model, defined with the cache simulator below
+void cacheAccess(SiaVM *vm, Cache *cache, unsigned int pc, unsigned int address, unsigned int length);
+
+//predictNext - where fetch goes after the instruction at pc. Without a predictor that is always the
+//next instruction. The static predictor takes backward branches, calls and jumps. The 2-bit predictor
+//takes branches whose counter says taken, and only to targets the branch target buffer has seen.
+//Both predict returns from the return address stack.
+unsigned int predictNext(SiaVM *vm, DecodedInstruction *instruction, unsigned int pc) {
+    unsigned int next = pc + instruction->length;
+    if(vm->predictor == PREDICT_NONE) {
+        return next;
+    }
+
+    //return address stack - SIA programs push their own return address, fetch guesses the one after the call
+    unsigned char flags = isaFlags(instruction);
+    if(flags & ISA_CALL) {
+        vm->returnStack[vm->returnStackTop++ % RETURN_STACK_SIZE] = next;
+    }
+    if(flags & ISA_RETURN) {
+        return vm->returnStack[--vm->returnStackTop % RETURN_STACK_SIZE];
+    }
+    if(!(flags & ISA_CONTROL)) {
+        return next;
+    }
+
+    if(vm->predictor == PREDICT_STATIC) {
+        bool taken = instruction->opcode2 >= 6 || instruction->target < pc;
+        return taken ? instruction->target : next;
+    }
+    TargetBufferEntry *entry = &vm->targetBuffer[(pc >> 1) % PREDICTOR_SIZE];
+    bool taken = instruction->opcode2 >= 6 || vm->counters[(pc >> 1) % PREDICTOR_SIZE] >= 2;
+    return (taken && entry->valid && entry->pc == pc) ? entry->target : next;
+}
+
+//resolvePrediction - store step, checks where the instruction at pc really went against where fetch
+//went after it. A mispredicted instruction squashes the pipeline and sends fetch down the right path.
+//Branches train the 2-bit counters and the branch target buffer.
+void resolvePrediction(SiaVM *vm, DecodedInstruction *instruction, unsigned int pc) {
+    bool taken = vm->PC != pc + instruction->length;
+    unsigned char flags = isaFlags(instruction);
+    if(flags & ISA_CONTROL) {
+        vm->branches++;
+    }
+    if(vm->predictor == PREDICT_2BIT && (flags & ISA_CONTROL) && !(flags & ISA_RETURN)) {
+        unsigned char *counter = &vm->counters[(pc >> 1) % PREDICTOR_SIZE];
+        if(taken && *counter < 3) {
+            (*counter)++;
+        }
+        else if(!taken && *counter > 0) {
+            (*counter)--;
+        }
+        if(taken) {
+            TargetBufferEntry *entry = &vm->targetBuffer[(pc >> 1) % PREDICTOR_SIZE];
+            entry->pc = pc;
+            entry->target = vm->PC;
+            entry->valid = 1;
+        }
+    }
+
+    if(vm->PC != vm->fetchPC) {
+        //when a branch is mispredicted, the instructions fetched after it become invalid
+        invalidatePipeline(vm);
+        vm->fetchPC = vm->PC;
+        vm->cycle += FLUSH_PENALTY;
+    }
+    else if(taken) {
+        vm->flushesAvoided++;
+    }
+}
+
+//fetch function - fetches the next instruction at the location indicated by fetchPC, the program counter
+//on the predicted path. The instruction comes out of the predecoded instruction cache, which decodes the
+//4 bytes at PC the first time they are fetched. Preforms a check to see if the program counter is
 //about to reach the top of the stack.
-void fetchInstruction() {
+void fetchInstruction(SiaVM *vm) {
     //printf("DEBUG: begin fetch...\n");
-    unsigned char instruction[4];
 
-    if(PC + 4 >= registers[15]) {
-        //instructions and stack may have collided. Fetch may retrieve stack data
-        printf("Error! Instructions and stack may have collided. Stack ptr: %d, PC: %d\n", registers[15], PC);
-        exit(1);
+    //with a guard page below the stack the MMU does this check
+    if(vm->stackGuard == NULL && vm->fetchPC + 4 >= vm->registers[15]) {
+        stackCollision(vm, vm->fetchPC);
+        return;
     }
     
-    //fetch the 4 bytes at PC in vitrualMemory, the next 2- or 4-byte instruction and place into one of the two buffers
-    if (decodeBuff1Ready) {
-        decodeBuff1Ready = 0;
-        for (int i = 0; i < 4; i++) {
-            decodeInstructionBuffer1[i] = virtualMemory[PC + i];
-        }
-        decodeBuff1Ready = 1;
+    //fetch the decoded record for the next 2- or 4-byte instruction at PC and place into one of the two buffers
+    DecodedInstruction *instruction = fetchDecoded(vm, vm->fetchPC);
+    //nothing is fetched from the instruction cache once the VM has halted
+    if(vm->icache != NULL && !vm->halt) {
+        cacheAccess(vm, vm->icache, vm->fetchPC, vm->fetchPC, instruction->length);
     }
-    else if(decodeBuff2Ready) {
-        decodeBuff2Ready = 0;
-        for (int i = 0; i < 4; i++) {
-            decodeInstructionBuffer2[i] = virtualMemory[PC + i];
-        }
-        decodeBuff2Ready = 1;
+    vm->fetchPC = predictNext(vm, instruction, vm->fetchPC);
+    if (vm->decodeBuff1Ready) {
+        vm->decodeBuff1Ready = 0;
+        vm->decodeInstructionBuffer1 = *instruction;
+        vm->decodeBuff1Ready = 1;
+    }
+    else if(vm->decodeBuff2Ready) {
+        vm->decodeBuff2Ready = 0;
+        vm->decodeInstructionBuffer2 = *instruction;
+        vm->decodeBuff2Ready = 1;
     }
 
-    decodeInstructionValid = 1;
+    vm->decodeInstructionValid = 1;
 }
 
 //decode function - looks at the opcodes of the instruction fetched and prepares for execution
-void decodeInstruction() {
+void decodeInstruction(SiaVM *vm) {
     //printf("DEBUG: begin decode...\n");
 
-    if(decodeInstructionValid) {
+    if(vm->decodeInstructionValid) {
         //copy current instruciton from an open double-buffer to local buffer, mute buffer during copy
-        unsigned char instruction[4];
-        if(decodeBuff1Ready) {
-            decodeBuff1Ready = 0;
-            for (int i = 0; i < 4; i++) {
-                instruction[i] = decodeInstructionBuffer1[i];
-            }
-            decodeBuff1Ready = 1;
+        DecodedInstruction instruction;
+        if(vm->decodeBuff1Ready) {
+            vm->decodeBuff1Ready = 0;
+            instruction = vm->decodeInstructionBuffer1;
+            vm->decodeBuff1Ready = 1;
         }
-        else if(decodeBuff2Ready) {
-            decodeBuff2Ready = 0;
-            for (int i = 0; i < 4; i++) {
-                instruction[i] = decodeInstructionBuffer2[i];
-            }
-            decodeBuff2Ready = 1;
+        else if(vm->decodeBuff2Ready) {
+            vm->decodeBuff2Ready = 0;
+            instruction = vm->decodeInstructionBuffer2;
+            vm->decodeBuff2Ready = 1;
         }
 
-
-        //all instrucitons begin with a 4-bit opcode, branch and stack have a secondary opcode
-        unsigned char opcode;
-        unsigned char opcode2;
-        opcode = highHalfByte(instruction[0]);
-        if(opcode == 7){opcode2 = lowHalfByte(instruction[0]);}
-        else if(opcode == 10) {opcode2 = instruction[1] >> 6;}
-
+        //opcodes and register numbers were already pulled apart when the instruction was predecoded, and
+        //its ISA flags say which registers it reads
+        unsigned char flags = isaFlags(&instruction);
 
         int OP1;
         int OP2;
         //load contents into OP1 & OP2 if necessary
-        if(opcode >= 1 && opcode <= 6) {
-            //3R instruction
-            OP1 = registers[get3R1(instruction)];
-            OP2 = registers[get3R2(instruction)];
+        if(flags & ISA_OPERANDS) {
+            //3R instructions and conditional branches
+            OP1 = vm->registers[instruction.reg1];
+            OP2 = vm->registers[instruction.reg2];
         }
-        else if(opcode == 7 && opcode2 >= 0 && opcode2 <= 5) {
-            OP1 = registers[getBR1(instruction)];
-            OP2 = registers[getBR2(instruction)];
-        }
-        else if(opcode == 8 || opcode == 9) {
-            OP1 = registers[highHalfByte(instruction[1])]; //address register
+        else if(flags & ISA_ADDRESS) {
+            OP1 = vm->registers[instruction.reg2]; //address register
         }
 
         //fill out one of the two buffers which go to execute step as input. Also includes double buffered OP1 & OP2
-        if(executeBuff1Ready) {
-            executeBuff1Ready = 0;//mute
-            OP1_1 = OP1;
-            OP1_2 = OP2;
-            for (int i = 0; i < 4; i++) {
-                executeInstructionBuffer1[i] = instruction[i];
-            }
-            executeBuff1Ready = 1;//unmute
+        if(vm->executeBuff1Ready) {
+            vm->executeBuff1Ready = 0;//mute
+            vm->OP1_1 = OP1;
+            vm->OP1_2 = OP2;
+            vm->executeInstructionBuffer1 = instruction;
+            vm->executeBuff1Ready = 1;//unmute
         }
-        else if(executeBuff2Ready) {
-            executeBuff2Ready = 0;//mute
-            OP2_1 = OP1;
-            OP2_2 = OP2;
-            for (int i = 0; i < 4; i++) {
-                executeInstructionBuffer2[i] = instruction[i];
-            }
-            executeBuff2Ready = 1;//unmute
+        else if(vm->executeBuff2Ready) {
+            vm->executeBuff2Ready = 0;//mute
+            vm->OP2_1 = OP1;
+            vm->OP2_2 = OP2;
+            vm->executeInstructionBuffer2 = instruction;
+            vm->executeBuff2Ready = 1;//unmute
         }
 
-        executeInstructionValid = 1;
+        vm->executeInstructionValid = 1;
     }
 
 }
 
 
-//execute function - considers the decoded opcodes to determine
-//control flow, executing the instructed operation in a series
-//of nested switches.
-void executeInstruction() {
+//execute function - considers the decoded handler number to determine
+//control flow, executing the instructed operation in one switch.
+void executeInstruction(SiaVM *vm) {
     //printf("DEBUG: begin execute...\n");
 
-    if(executeInstructionValid) {
+    if(vm->executeInstructionValid) {
         //prepare local variables with data from mutable double buffers outputted by decode function
-        unsigned char instruction[4];
-        unsigned char opcode, opcode2;
+        DecodedInstruction instruction;
         int OP1, OP2, result;
-        if(executeBuff1Ready) {
-            executeBuff1Ready = 0; //mute buffer
-            OP1 = OP1_1;
-            OP2 = OP1_2;
-            for (int i = 0; i < 4; i++) {
-                instruction[i] = executeInstructionBuffer1[i];
-            }
-            executeBuff1Ready = 1; //unmute buffer
+        if(vm->executeBuff1Ready) {
+            vm->executeBuff1Ready = 0; //mute buffer
+            OP1 = vm->OP1_1;
+            OP2 = vm->OP1_2;
+            instruction = vm->executeInstructionBuffer1;
+            vm->executeBuff1Ready = 1; //unmute buffer
         }
-        else if(executeBuff2Ready) { 
-            executeBuff2Ready = 0; //mute buffer
-            OP1 = OP2_1;
-            OP2 = OP2_2;
-            for (int i = 0; i < 4; i++) {
-                instruction[i] = executeInstructionBuffer2[i];
-            }
-            executeBuff2Ready = 1; //unmute buffer
+        else if(vm->executeBuff2Ready) { 
+            vm->executeBuff2Ready = 0; //mute buffer
+            OP1 = vm->OP2_1;
+            OP2 = vm->OP2_2;
+            instruction = vm->executeInstructionBuffer2;
+            vm->executeBuff2Ready = 1; //unmute buffer
         }
 
-        //all instrucitons begin with a 4-bit opcode, branch and stack have 2 opcodes
-        opcode = highHalfByte(instruction[0]);
-        if(opcode == 7){opcode2 = lowHalfByte(instruction[0]);}
-        else if(opcode == 10) {opcode2 = instruction[1] >> 6;}
+        //register forwarding - overwrite operands with values still in flight on the scoreboard
+        if(isaFlags(&instruction) & ISA_OPERANDS) {
+            OP1 = scoreboardCheck(vm, instruction.reg1);
+            OP2 = scoreboardCheck(vm, instruction.reg2);
+        }
 
-        //big outer opcode switch, considers the primary opcode for instruciton type
-        switch(opcode)
+        //one switch over the handler number picked at predecode, no opcode and opcode2 to take apart
+        unsigned int loc;
+        switch(instruction.handler)
         {
-            //register forwarding - check register history, overwrite current values with most recent values if they are present
-            OP1 = historyCheck(get3R1(instruction), OP1);
-            OP2 = historyCheck(get3R2(instruction), OP2);
-            int reg; //needed later during case blocks
-
             //3R instructions - these simply preform the operation on two registers, and store the result for later
-            case 1://add
+            case HANDLER_ADD:
                 result = OP1 + OP2;
                 break;
             
-            case 2://and
-                result = OP1 & OP1;
-                break;
-
-            case 3://divide
-                result = OP1 / OP1;
-                break;
-
-            case 4://multiply
-                result = OP1 * OP1;
-                break;
-
-            case 5://subtract
-                result = OP1 - OP1;
-                break;
-
-            case 6: //or
-                result = OP1 | OP1;
-                break;
-
-            //branch instructions
-            case 7:
-            //register forwarding - check register history, overwrite current values with most recent values if they are present
-            OP1 = historyCheck(getBR1(instruction), OP1);
-            OP2 = historyCheck(getBR2(instruction), OP2);
-
-                //inner switch for the bracnhes as well as jump and call denoted by secondary opcode
-                switch(opcode2)
-                {
-                    case 0://branchifless
-                        //if first register contents < second register contents
-                        if(OP1 < OP2) {
-                            //result = reconstructed address offset from instruction octets 2 and 3
-                            result = (instruction[2] << 8) | instruction[3];
-                        }
-                        //if the test fails, no branch. set result to -1
-                        else result = -1;
-                        //Each of the following conditional branches follows this same pattern.
-                        break;
-
-                    case 1://branchiflessorequal
-                        if(OP1 <= OP2) {
-                            result = (instruction[2] << 8) | instruction[3];
-                        }
-                        else result = -1;
-                        break;
-                    
-                    case 2://branchifequal
-                        if(OP1 == OP2) {
-                            result = (instruction[2] << 8) | instruction[3];
-                        }
-                        else result = -1;
-                        break;
-                    
-                    case 3://branchfnotequal
-                        if(OP1 != OP2) {
-                            result = (instruction[2] << 8) | instruction[3];
-                        }
-                        else result = -1;
-                        break;
-
-                    case 4://branchifgreater
-                        if(OP1 > OP2) {
-                            result = (instruction[2] << 8) | instruction[3];
-                        }
-                        else result = -1;
-                        break;
-                    
-                    case 5://branchifgreaterorequal
-                        if(OP1 >= OP2) {
-                            result = (instruction[2] << 8) | instruction[3];
-                        }
-                        else result = -1;
-                        break;
-
-                    //call and jump both reconstruct an address from instruction octets 1-3
-                    case 6://call
-                        result = (instruction[1] << 16) | (instruction[2] << 8) | (instruction[3]);
-                        break;
-
-                    case 7://jump
-                        result = (instruction[1] << 16) | (instruction[2] << 8) | (instruction[3]);
-                        break;
+            case HANDLER_AND:
+                result = OP1 & OP2;
+                break;
+
+            case HANDLER_DIVIDE:
+                if(badDivide(OP1, OP2)) {
+                    //the store step writes the register back unchanged
+                    divideError(vm, OP1, OP2, vm->PC);
+                    result = scoreboardCheck(vm, instruction.reg3);
+                    break;
                 }
+                result = OP1 / OP2;
                 break;
 
-            //load/store instructions
-            unsigned int loc;
-            case 8://load
-                //loc = address held in specified register + offset
-                reg = highHalfByte(instruction[1]);
-                loc = registers[reg];
-                loc = historyCheck(reg, loc);
-                loc += lowHalfByte(instruction[1]);
-                //result = the 4 bytes found in memory at loc
-                result = (virtualMemory[loc] << 24) | (virtualMemory[loc + 1] << 16) | (virtualMemory[loc + 2] << 8) | (virtualMemory[loc +3]);
+            case HANDLER_MULTIPLY:
+                result = OP1 * OP2;
                 break;
 
-            case 9://store
-                //result = address held in specified register + offset, location to store data in next step
-                reg = highHalfByte(instruction[1]);
-                result = registers[reg];
-                result = historyCheck(reg, result);
-                result += lowHalfByte(instruction[1]);
-                break;
-
-            //stack instructions
-            case 10:
-                //inner switch for push, pop, and return specified by secondary opcode
-                switch(opcode2) 
-                {
-                    int reg;
-                    case 0://return
-                        //location = stack pointer
-                        loc = registers[15];
-                        loc = historyCheck(15, loc);
-                        //result = 4 bytes found in virtual memory at loc - address to return to
-                        result = (virtualMemory[loc] << 24) | (virtualMemory[loc + 1] << 16) | (virtualMemory[loc + 2] << 8) | (virtualMemory[loc +3]);
-                        break;
-
-                    case 1://push
-                        //result = stack pointer, location to push data for use in store step
-                        reg = getStackRegister(instruction);
-                        result = registers[reg];
-                        result = historyCheck(reg, result);
-                        break;
-
-                    case 2://pop
-                        //loc = stack pointer
-                        loc = registers[15];
-                        loc = historyCheck(15, loc);
-                        //result = 4 bytes found in memory at loc - data to pop off stack
-                        result = (virtualMemory[loc] << 24) | (virtualMemory[loc + 1] << 16) | (virtualMemory[loc + 2] << 8) | (virtualMemory[loc +3]);
-                        break;
+            case HANDLER_SUBTRACT:
+                result = OP1 - OP2;
+                break;
+
+            case HANDLER_OR:
+                result = OP1 | OP2;
+                break;
 
+            //conditional branches
+            case HANDLER_BRANCHIFLESS:
+                //if first register contents < second register contents
+                if(OP1 < OP2) {
+                    //result = branch target, PC + the offset from instruction octets 2 and 3
+                    result = instruction.target;
                 }
+                //if the test fails, no branch. set result to -1
+                else result = -1;
+                //Each of the following conditional branches follows this same pattern.
                 break;
-                
 
-            case 11://move
-                //get the immedate value from move instrucitons, converted to signed
-                result = getImmediate(instruction);
+            case HANDLER_BRANCHIFLESSOREQUAL:
+                if(OP1 <= OP2) {
+                    result = instruction.target;
+                }
+                else result = -1;
                 break;
             
-            case 12://interrupt
-                if(instruction[1] == 0) {//interrupt 0 instructs VM to print registers, 16 in total
-                    printf("Register contents: \n");
-                    for(int i = 0; i < 16; i++) {
-                        int reg = i;
-                        int value = registers[i];
-                        value = historyCheck(reg, value);//use historic data if present
-                        printf("Reg[%-2d]: %d\n", i, value);
-                    }
+            case HANDLER_BRANCHIFEQUAL:
+                if(OP1 == OP2) {
+                    result = instruction.target;
                 }
-                else if(instruction[1] == 1) {//interrupt 1 instructs VM to print memory contents, 1KB in total arrayed 20 bytes per line
-                    printf("Memory contents: \n=================================================================\n");
-                    for(int i = 0; i < 1000; i++){
-                        if(i % 20 == 0 && i != 0) //every 20 bytes print line number (bytes) and newline
-                            printf(" %0 4d\n", (i-20));
-                        printf("%02X ", virtualMemory[i]);
-                    }
-                    printf(" %0 4d\n=================================================================\n", 980);
+                else result = -1;
+                break;
+            
+            case HANDLER_BRANCHIFNOTEQUAL:
+                if(OP1 != OP2) {
+                    result = instruction.target;
                 }
+                else result = -1;
                 break;
 
-            case 0://halt - stops main execution loop upon next loop start
-                halt = 1;
+            case HANDLER_BRANCHIFGREATER:
+                if(OP1 > OP2) {
+                    result = instruction.target;
+                }
+                else result = -1;
+                break;
+            
+            case HANDLER_BRANCHIFGREATEROREQUAL:
+                if(OP1 >= OP2) {
+                    result = instruction.target;
+                }
+                else result = -1;
                 break;
 
-        }//end of the big outer opcode switch
+            //call and jump both use the address from instruction octets 1-3
+            case HANDLER_CALL:
+            case HANDLER_JUMP:
+                result = instruction.target;
+                break;
 
-        //fill in double buffer for store
-        if(storeBuff1Ready) {
-            storeBuff1Ready = 0;//mute
-            result1 = result;
-            for (int i = 0; i < 4; i++) {
-                storeInstructionBuffer1[i] = instruction[i];
-            }
+            //load/store instructions
+            case HANDLER_LOAD:
+                //loc = address held in specified register + offset
+                loc = scoreboardCheck(vm, instruction.reg2);
+                loc += instruction.immediate;
+                if(vm->dcache != NULL) {
+                    cacheAccess(vm, vm->dcache, vm->PC, loc, 4);
+                }
+                //result = the 4 bytes found in memory at loc
+                result = readWord(vm, loc);
+                break;
+
+            case HANDLER_STORE:
+                //result = address held in specified register + offset, location to store data in next step
+                result = scoreboardCheck(vm, instruction.reg2);
+                result += instruction.immediate;
+                break;
+
+            //stack instructions - return and pop both read the word at the stack pointer
+            case HANDLER_RETURN:
+            case HANDLER_POP:
+                //location = stack pointer
+                loc = scoreboardCheck(vm, 15);
+                if(vm->dcache != NULL) {
+                    cacheAccess(vm, vm->dcache, vm->PC, loc, 4);
+                }
+                //result = 4 bytes found in virtual memory at loc - the address to return to, or the data to pop
+                result = readWord(vm, loc);
+                break;
+
+            case HANDLER_PUSH:
+                //result = the data to push onto the stack in the store step
+                result = scoreboardCheck(vm, instruction.reg1);
+                break;
+
+            case HANDLER_MOVE:
+                //get the immedate value from move instrucitons, converted to signed
+                result = instruction.immediate;
+                break;
+            
+            case HANDLER_INTERRUPT:
+                if(instruction.immediate == 0) {//interrupt 0 instructs VM to print registers, 16 in total
+                    //the store step has already written every result back, no forwarding needed
+                    dumpRegisters(vm, vm->registers);
+                }
+                else if(instruction.immediate == 1) {//interrupt 1 instructs VM to print memory contents
+                    dumpMemory(vm);
+                }
+                else if(instruction.immediate == 2) {//interrupt 2 snapshots the VM once this cycle is over
+                    vm->snapshotPending = vm->snapshotFile != NULL;
+                }
+                else if(instruction.immediate == 3 && vm->checkpoint) {//interrupt 3 halts at the checkpoint
+                    vm->checkpoint = 0;
+                    vm->halt = 1;
+                }
+                else if(instruction.immediate == 4) {//interrupt 4 prints the memory changed since loading
+                    dumpChanges(vm);
+                }
+                break;
+
+            case HANDLER_HALT://halt - stops main execution loop upon next loop start
+                vm->halt = 1;
+                break;
+
+        }//end of the handler switch
+
+        //fill in double buffer for store
+        if(vm->storeBuff1Ready) {
+            vm->storeBuff1Ready = 0;//mute
+            vm->result1 = result;
+            vm->storeInstructionBuffer1 = instruction;
+
+            vm->storeBuff1Ready = 1;//unmute
+        }
+        else if(vm->storeBuff2Ready) {
+            vm->storeBuff2Ready = 0;//mute
+            vm->result2 = result;
+            vm->storeInstructionBuffer2 = instruction;
+            vm->storeBuff2Ready = 1;//unmute
+        }
+
+        vm->storeInstructionValid = 1;
+    }
+
+}
+
+
+//store function - takes results from execute and stores them in memory or registers as instructed,
+//then updates program counter as needed.
+void storeResult(SiaVM *vm) {
+    //printf("DEBUG: begin store...\n");
+
+    if(vm->storeInstructionValid) {
+        //prepare local variables with data from mutable double buffers outputted by execute function
+        DecodedInstruction instruction;
+        int result;
+        if(vm->storeBuff1Ready) {
+            vm->storeBuff1Ready = 0; //mute buffer
+            result = vm->result1;
+            instruction = vm->storeInstructionBuffer1;
+            vm->storeBuff1Ready = 1; //unmute buffer
+        }
+        else if(vm->storeBuff2Ready) { 
+            vm->storeBuff2Ready = 0; //mute buffer
+            result = vm->result2;
+            instruction = vm->storeInstructionBuffer2;
+            vm->storeBuff2Ready = 1; //unmute buffer
+        }
+
+        unsigned int pc = vm->PC;
+        vm->retired++;
+        vm->mix[instruction.handler]++;
+
+        switch(instruction.handler) {
+            int reg;
+            //3R instructions
+            case HANDLER_ADD: case HANDLER_AND: case HANDLER_DIVIDE:
+            case HANDLER_MULTIPLY: case HANDLER_SUBTRACT: case HANDLER_OR:
+                reg = instruction.reg3;
+                vm->registers[reg] = result;
+                scoreboardLog(vm, reg, result, 0);
+                vm->PC += 2;
+                break;
+
+            //conditional branches - 4-byte instructions
+            case HANDLER_BRANCHIFLESS: case HANDLER_BRANCHIFLESSOREQUAL: case HANDLER_BRANCHIFEQUAL:
+            case HANDLER_BRANCHIFNOTEQUAL: case HANDLER_BRANCHIFGREATER: case HANDLER_BRANCHIFGREATEROREQUAL:
+                //condition for branching not met
+                if(result == -1) {
+                    vm->PC += 4;
+                }
+                //condition for branching met, result holds the target resolved at predecode
+                else {
+                    vm->PC = result;
+                }
+                break;
+
+            case HANDLER_CALL:
+            case HANDLER_JUMP:
+                vm->PC = result;
+                break;
+
+            case HANDLER_LOAD:
+                //store result in specified register
+                reg = instruction.reg1;
+                vm->registers[reg] = result;
+                scoreboardLog(vm, reg, result, 1); //log register change for later forwarding
+                vm->PC += 2;
+                break;
+
+            case HANDLER_STORE:
+                //store data from specified 32-bit register into 4 bytes of virtual memory,
+                //by splitting and shifting each octet.
+                if(vm->dcache != NULL) {
+                    cacheAccess(vm, vm->dcache, pc, result, 4);
+                }
+                writeWord(vm, result, vm->registers[instruction.reg1]);
+                vm->PC += 2;
+                break;
+
+            //stack instructions, every one moves the stack pointer
+            case HANDLER_RETURN:
+                //update the stack pointer, down 4 bytes as data was popped off in execute step
+                moveStackPointer(vm, 4);
+                //update program counter to new instruciton location for next fetch
+                vm->PC = result;
+                scoreboardLog(vm, 15, vm->registers[15], 0);
+                break;
+
+            case HANDLER_PUSH:
+                //update stack pointer, up 4 butes as we push data onto stack
+                moveStackPointer(vm, -4);
+                if(vm->dcache != NULL) {
+                    cacheAccess(vm, vm->dcache, pc, vm->registers[15], 4);
+                }
+                //store data from execute result in virtual memory at stack pointer by shifting and storing each octet
+                writeWord(vm, vm->registers[15], result);
+                vm->PC += 2;
+                scoreboardLog(vm, 15, vm->registers[15], 0);
+                break;
+
+            case HANDLER_POP:
+                //store execute result in specified register
+                reg = instruction.reg1;
+                vm->registers[reg] = result;
+                scoreboardLog(vm, reg, result, 1);
+                //move stack pointer down 4 bytes as we popped off data
+                moveStackPointer(vm, 4);
+                vm->PC += 2;
+                scoreboardLog(vm, 15, vm->registers[15], 0);
+                break;
+
+            case HANDLER_MOVE:
+                //store result from execute in specified register
+                reg = instruction.reg1;
+                vm->registers[reg] = result;
+                scoreboardLog(vm, reg, result, 0);
+                vm->PC += 2;
+                break;
+
+            //interrupt and halt only need to advance the program counter here. Halt stops execution
+            //before the next fetch anyway.
+            case HANDLER_INTERRUPT:
+            case HANDLER_HALT:
+                vm->PC += 2;
+                break;
+
+            //opcodes 13-15 and stack opcode2 3 are unused
+            default:
+                illegalInstruction(vm, instruction.opcode, instruction.opcode2, vm->PC);
+                return;
+        }
+
+        //for a store, result is the address it wrote
+        if(vm->trace != NULL) {
+            traceInstruction(vm, pc & vm->memoryMask, &instruction, result);
+        }
+
+        //squash the pipeline if fetch went the wrong way after this instruction
+        resolvePrediction(vm, &instruction, pc);
+    }
+}
+
+////////////////////////////
+// Fast Functional Engine //
+////////////////////////////
+// runFast executes the program for its architectural result only, skipping the pipeline model: no
+// double buffers, ready/valid flags or scoreboard. Dispatch is direct-threaded. Each predecoded
+// record carries a handler number, and every handler ends by jumping straight to the handler of the
+// next instruction through a table of label addresses (GCC/Clang computed goto).
+
+//DISPATCH - stop once the budget is used up, fetch the next predecoded instruction and jump to its
+//handler, through its stack check unless the VM has a guard page. Records that are already decoded
+//are looked up in place, only missing pages and records go through fetchDecoded.
+#define DISPATCH() \
+    if(executed == budget) { \
+        return executed; \
+    } \
+    executed++; \
+    loc = vm->PC & memoryMask; \
+    page = decodePages[loc >> CODE_PAGE_BITS]; \
+    instruction = (page != NULL) ? &page[loc & (CODE_PAGE_SIZE - 1)] : NULL; \
+    if(instruction == NULL || !instruction->valid) { \
+        instruction = fetchDecoded(vm, loc); \
+    } \
+    goto *dispatch[instruction->handler]
+
+//STACK_CHECK - fetch's check for a stack collision, run before the handler it is named for
+#define STACK_CHECK(handler) \
+    check##handler: \
+        if(vm->PC + 4 >= vm->registers[15]) { \
+            stackCollision(vm, vm->PC); \
+            return executed; \
+        } \
+        goto handler;
+
+//runFast - executes at most budget instructions, or until halt. Returns the number executed.
+unsigned long long runFast(SiaVM *vm, unsigned long long budget) {
+    //one label per HANDLER_ number, in the same order as the enum
+    static void *handlers[HANDLER_COUNT] = {
+        &&halt, &&add, &&and, &&divide, &&multiply, &&subtract, &&or,
+        &&branchifless, &&branchiflessorequal, &&branchifequal, &&branchifnotequal,
+        &&branchifgreater, &&branchifgreaterorequal, &&call, &&jump,
+        &&load, &&store, &&stackreturn, &&push, &&pop, &&move, &&interrupt,
+        &&illegal
+    };
+    //the same handlers with the stack check in front. With a guard page below the stack the host MMU
+    //catches collisions instead, and the check is left out.
+    static void *checkedHandlers[HANDLER_COUNT] = {
+        &&checkhalt, &&checkadd, &&checkand, &&checkdivide, &&checkmultiply, &&checksubtract, &&checkor,
+        &&checkbranchifless, &&checkbranchiflessorequal, &&checkbranchifequal, &&checkbranchifnotequal,
+        &&checkbranchifgreater, &&checkbranchifgreaterorequal, &&checkcall, &&checkjump,
+        &&checkload, &&checkstore, &&checkstackreturn, &&checkpush, &&checkpop, &&checkmove, &&checkinterrupt,
+        &&checkillegal
+    };
+    void **dispatch = (vm->stackGuard != NULL) ? handlers : checkedHandlers;
+    DecodedInstruction *instruction;
+    DecodedInstruction *page;
+    DecodedInstruction **decodePages = vm->decodePages;
+    unsigned int memoryMask = vm->memoryMask;
+    unsigned int loc;
+    unsigned long long executed = 0;
+
+    DISPATCH();
+
+    //3R instructions
+    add:
+        vm->registers[instruction->reg3] = vm->registers[instruction->reg1] + vm->registers[instruction->reg2];
+        vm->PC += 2;
+        DISPATCH();
+    and:
+        vm->registers[instruction->reg3] = vm->registers[instruction->reg1] & vm->registers[instruction->reg2];
+        vm->PC += 2;
+        DISPATCH();
+    divide:
+        if(badDivide(vm->registers[instruction->reg1], vm->registers[instruction->reg2])) {
+            divideError(vm, vm->registers[instruction->reg1], vm->registers[instruction->reg2], vm->PC);
+            return executed;
+        }
+        vm->registers[instruction->reg3] = vm->registers[instruction->reg1] / vm->registers[instruction->reg2];
+        vm->PC += 2;
+        DISPATCH();
+    multiply:
+        vm->registers[instruction->reg3] = vm->registers[instruction->reg1] * vm->registers[instruction->reg2];
+        vm->PC += 2;
+        DISPATCH();
+    subtract:
+        vm->registers[instruction->reg3] = vm->registers[instruction->reg1] - vm->registers[instruction->reg2];
+        vm->PC += 2;
+        DISPATCH();
+    or:
+        vm->registers[instruction->reg3] = vm->registers[instruction->reg1] | vm->registers[instruction->reg2];
+        vm->PC += 2;
+        DISPATCH();
+
+    //branch instructions - the target was resolved when the instruction was predecoded
+    branchifless:
+        vm->PC = (vm->registers[instruction->reg1] < vm->registers[instruction->reg2]) ? instruction->target : vm->PC + 4;
+        DISPATCH();
+    branchiflessorequal:
+        vm->PC = (vm->registers[instruction->reg1] <= vm->registers[instruction->reg2]) ? instruction->target : vm->PC + 4;
+        DISPATCH();
+    branchifequal:
+        vm->PC = (vm->registers[instruction->reg1] == vm->registers[instruction->reg2]) ? instruction->target : vm->PC + 4;
+        DISPATCH();
+    branchifnotequal:
+        vm->PC = (vm->registers[instruction->reg1] != vm->registers[instruction->reg2]) ? instruction->target : vm->PC + 4;
+        DISPATCH();
+    branchifgreater:
+        vm->PC = (vm->registers[instruction->reg1] > vm->registers[instruction->reg2]) ? instruction->target : vm->PC + 4;
+        DISPATCH();
+    branchifgreaterorequal:
+        vm->PC = (vm->registers[instruction->reg1] >= vm->registers[instruction->reg2]) ? instruction->target : vm->PC + 4;
+        DISPATCH();
+    call:
+        vm->PC = instruction->target;
+        DISPATCH();
+    jump:
+        vm->PC = instruction->target;
+        DISPATCH();
+
+    //load/store instructions
+    load:
+        loc = vm->registers[instruction->reg2] + instruction->immediate;
+        vm->registers[instruction->reg1] = readWord(vm, loc);
+        vm->PC += 2;
+        DISPATCH();
+    store:
+        loc = vm->registers[instruction->reg2] + instruction->immediate;
+        writeWord(vm, loc, vm->registers[instruction->reg1]);
+        vm->PC += 2;
+        DISPATCH();
+
+    //stack instructions
+    stackreturn:
+        loc = readWord(vm, vm->registers[15]);
+        moveStackPointer(vm, 4);
+        vm->PC = loc;
+        DISPATCH();
+    push:
+        moveStackPointer(vm, -4);
+        writeWord(vm, vm->registers[15], vm->registers[instruction->reg1]);
+        vm->PC += 2;
+        DISPATCH();
+    pop:
+        vm->registers[instruction->reg1] = readWord(vm, vm->registers[15]);
+        moveStackPointer(vm, 4);
+        vm->PC += 2;
+        DISPATCH();
+
+    move:
+        vm->registers[instruction->reg1] = instruction->immediate;
+        vm->PC += 2;
+        DISPATCH();
+
+    interrupt:
+        if(instruction->immediate == 0) {
+            dumpRegisters(vm, vm->registers);
+        }
+        else if(instruction->immediate == 1) {
+            dumpMemory(vm);
+        }
+        else if(instruction->immediate == 4) {
+            dumpChanges(vm);
+        }
+        vm->PC += 2;
+        if(instruction->immediate == 2 && vm->snapshotFile != NULL) {
+            writeSnapshot(vm);
+        }
+        else if(instruction->immediate == 3 && vm->checkpoint) {
+            vm->checkpoint = 0;
+            vm->halt = 1;
+            return executed;
+        }
+        else if(instruction->immediate == 5 && vm->sampleMarker) {
+            vm->markerReached = 1;
+            return executed;
+        }
+        DISPATCH();
+
+    illegal:
+        illegalInstruction(vm, instruction->opcode, instruction->opcode2, vm->PC);
+        return executed;
+
+    halt:
+        vm->halt = 1;
+        vm->PC += 2;
+        return executed;
+
+    STACK_CHECK(halt) STACK_CHECK(add) STACK_CHECK(and) STACK_CHECK(divide) STACK_CHECK(multiply)
+    STACK_CHECK(subtract) STACK_CHECK(or) STACK_CHECK(branchifless) STACK_CHECK(branchiflessorequal)
+    STACK_CHECK(branchifequal) STACK_CHECK(branchifnotequal) STACK_CHECK(branchifgreater)
+    STACK_CHECK(branchifgreaterorequal) STACK_CHECK(call) STACK_CHECK(jump) STACK_CHECK(load)
+    STACK_CHECK(store) STACK_CHECK(stackreturn) STACK_CHECK(push) STACK_CHECK(pop) STACK_CHECK(move)
+    STACK_CHECK(interrupt) STACK_CHECK(illegal)
+}
+
+//////////////////
+// JIT Compiler //
+//////////////////
+// --jit compiles basic blocks of SIA into x86-64 machine code. A block starts at any PC the dispatcher
+// reaches and runs through the arithmetic, move and branch instructions (opcodes 1, 2, 4, 5, 6, 7 and 11)
+// that follow it. It ends at a branch, call or jump, or before the first instruction it doesn't compile
+// (divide, memory, stack, interrupt and halt), which the fast engine then executes one at a time. Every
+// block exit is a small stub returning the next PC to the dispatcher. Once the target block exists the
+// stub is patched into a direct jump, so hot loops chain block to block without leaving native code.
+// Guest registers stay in the registers array, which generated code reaches through rdi. A store into
+// memory that holds compiled instructions throws every block away, so self-modifying code still works.
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#define JIT_BUFFER_SIZE (4 * 1024 * 1024)
+#define JIT_MAX_BLOCK_INSTRUCTIONS 64
+#define JIT_MAX_PENDING_EXITS 4096
+#define JIT_EXIT_STUB_SIZE 6
+#define JIT_NO_BLOCK ((unsigned char *)1) //marks a PC whose first instruction can't be compiled
+
+//generated code returns the next PC, with bit 32 set when the dispatcher should interpret instead
+typedef unsigned long long (*JitBlockFunction)(int *registers);
+
+//exit stub waiting for its target block to be compiled
+typedef struct JitPendingExit {
+    unsigned char *stub;
+    unsigned int target;
+} JitPendingExit;
+
+//compiled code for one VM, allocated by runJit
+struct JitState {
+    unsigned char *buffer;          //executable code buffer
+    unsigned int used;              //bytes of buffer used
+    unsigned char ***blockPages;    //compiled block for each PC in pages of CODE_PAGE_SIZE, NULL if not compiled yet
+    unsigned int pageCount;
+    unsigned int pageRecords;
+    JitPendingExit pendingExits[JIT_MAX_PENDING_EXITS];
+    int pendingCount;
+    unsigned int codeLow;           //lowest guest address covered by a compiled block
+    unsigned int codeHigh;          //one past the highest guest address covered by a compiled block
+};
+
+//jitBlock - the compiled block slot for pc, allocating its page when create is set. NULL when the page
+//doesn't exist, or pc is past the end of memory.
+unsigned char **jitBlock(JitState *jit, unsigned int pc, bool create) {
+    if((pc >> CODE_PAGE_BITS) >= jit->pageCount || (pc & (CODE_PAGE_SIZE - 1)) >= jit->pageRecords) {
+        return NULL;
+    }
+    unsigned char **page = jit->blockPages[pc >> CODE_PAGE_BITS];
+    if(page == NULL) {
+        if(!create) {
+            return NULL;
+        }
+        page = calloc(jit->pageRecords, sizeof(unsigned char *));
+        if(page == NULL) {
+            fprintf(stderr, "Error! Out of memory for compiled blocks\n");
+            exit(1);
+        }
+        jit->blockPages[pc >> CODE_PAGE_BITS] = page;
+    }
+    return &page[pc & (CODE_PAGE_SIZE - 1)];
+}
+
+//jitEmitByte, jitEmitWord - append machine code to the buffer
+void jitEmitByte(JitState *jit, unsigned char byte) {
+    jit->buffer[jit->used++] = byte;
+}
+
+void jitEmitWord(JitState *jit, unsigned int word) {
+    memcpy(jit->buffer + jit->used, &word, 4);
+    jit->used += 4;
+}
+
+//jitEmitRegisterOp - emits "<op> eax, [rdi + 4 * reg]" for the given opcode bytes
+void jitEmitRegisterOp(JitState *jit, unsigned char opcode, unsigned char reg) {
+    jitEmitByte(jit, opcode);
+    jitEmitByte(jit, 0x47);
+    jitEmitByte(jit, reg * 4);
+}
+
+//jitPatchJump - turns the code at from into "jmp to"
+void jitPatchJump(unsigned char *from, unsigned char *to) {
+    from[0] = 0xE9;
+    int offset = (int)(to - (from + 5));
+    memcpy(from + 1, &offset, 4);
+}
+
+//jitEmitExit - emits an exit to target. Jumps straight into the target block when it is already
+//compiled, otherwise emits "mov eax, target; ret" and remembers the stub so it can be patched later.
+void jitEmitExit(JitState *jit, unsigned int target) {
+    unsigned char *stub = jit->buffer + jit->used;
+    jitEmitByte(jit, 0xB8);
+    jitEmitWord(jit, target);
+    jitEmitByte(jit, 0xC3);
+
+    unsigned char **block = jitBlock(jit, target, 0);
+    if(block != NULL && *block != NULL && *block != JIT_NO_BLOCK) {
+        jitPatchJump(stub, *block);
+    }
+    else if(jit->pendingCount < JIT_MAX_PENDING_EXITS) {
+        jit->pendingExits[jit->pendingCount].stub = stub;
+        jit->pendingExits[jit->pendingCount].target = target;
+        jit->pendingCount++;
+    }
+}
+
+//jitFlush - drops every compiled block
+void jitFlush(JitState *jit) {
+    for(unsigned int i = 0; i < jit->pageCount; i++) {
+        if(jit->blockPages[i] != NULL) {
+            memset(jit->blockPages[i], 0, jit->pageRecords * sizeof(unsigned char *));
+        }
+    }
+    jit->used = 0;
+    jit->pendingCount = 0;
+    jit->codeLow = UINT_MAX;
+    jit->codeHigh = 0;
+}
+
+//jitCompilable - whether the JIT emits code for this instruction
+bool jitCompilable(DecodedInstruction *instruction) {
+    return instruction->handler != HANDLER_DIVIDE && instruction->handler >= HANDLER_ADD
+        && (instruction->handler <= HANDLER_JUMP || instruction->handler == HANDLER_MOVE);
+}
+
+//jitCompileBlock - compiles the block starting at start, returns its code or JIT_NO_BLOCK
+unsigned char *jitCompileBlock(SiaVM *vm, unsigned int start) {
+    JitState *jit = vm->jit;
+
+    //worst case per instruction is a branch: 3 + 3 + 6 bytes of compare and jcc plus two exit stubs
+    if(jit->used + 32 + JIT_MAX_BLOCK_INSTRUCTIONS * 32 > JIT_BUFFER_SIZE) {
+        jitFlush(jit);
+    }
+
+    if(start + 4ULL > vm->memorySize || !jitCompilable(fetchDecoded(vm, start))) {
+        return JIT_NO_BLOCK;
+    }
+
+    //find the end of the block first, the stack check in the prologue needs the last PC
+    unsigned int pc = start;
+    unsigned int last = start;
+    for(int count = 0; count < JIT_MAX_BLOCK_INSTRUCTIONS && pc + 4ULL <= vm->memorySize; count++) {
+        DecodedInstruction *instruction = fetchDecoded(vm, pc);
+        if(!jitCompilable(instruction)) {
+            break;
+        }
+        last = pc;
+        pc += instruction->length;
+        //branches end the block, and so does a write to the stack pointer since fetch checks against it
+        if(instruction->opcode == 7 || (instruction->opcode <= 6 && instruction->reg3 == 15)
+            || (instruction->opcode == 11 && instruction->reg1 == 15)) {
+            break;
+        }
+    }
+    unsigned int end = pc;
+
+    //register the block before emitting it so branches back to its own start chain directly
+    unsigned char *code = jit->buffer + jit->used;
+    *jitBlock(jit, start, 1) = code;
+
+    //prologue - same check as fetch, for the whole block at once: if the last instruction would
+    //collide with the stack, hand the block to the interpreter so it reports the exact PC.
+    //Left out when a guard page below the stack does the check.
+    //mov eax, [rdi + 60]; cmp eax, last + 4; jbe bail
+    unsigned char *bail = NULL;
+    if(vm->stackGuard == NULL) {
+        jitEmitRegisterOp(jit, 0x8B, 15);
+        jitEmitByte(jit, 0x3D);
+        jitEmitWord(jit, last + 4);
+        jitEmitByte(jit, 0x0F);
+        jitEmitByte(jit, 0x86);
+        bail = jit->buffer + jit->used;
+        jitEmitWord(jit, 0);
+    }
+
+    for(pc = start; pc < end; ) {
+        DecodedInstruction *instruction = fetchDecoded(vm, pc);
+        switch(instruction->handler) {
+            //3R - mov eax, [reg1]; <op> eax, [reg2]; mov [reg3], eax
+            case HANDLER_ADD: case HANDLER_AND: case HANDLER_MULTIPLY: case HANDLER_SUBTRACT: case HANDLER_OR:
+                jitEmitRegisterOp(jit, 0x8B, instruction->reg1);
+                if(instruction->handler == HANDLER_MULTIPLY) {
+                    jitEmitByte(jit, 0x0F);
+                    jitEmitRegisterOp(jit, 0xAF, instruction->reg2);
+                }
+                else {
+                    static const unsigned char aluOps[] = {0, 0x03, 0x23, 0, 0, 0x2B, 0x0B};
+                    jitEmitRegisterOp(jit, aluOps[instruction->handler], instruction->reg2);
+                }
+                jitEmitRegisterOp(jit, 0x89, instruction->reg3);
+                break;
+
+            //move - mov dword [reg1], immediate
+            case HANDLER_MOVE:
+                jitEmitByte(jit, 0xC7);
+                jitEmitByte(jit, 0x47);
+                jitEmitByte(jit, instruction->reg1 * 4);
+                jitEmitWord(jit, instruction->immediate);
+                break;
+
+            //call and jump - straight to the target
+            case HANDLER_CALL: case HANDLER_JUMP:
+                jitEmitExit(jit, instruction->target);
+                break;
+
+            //conditional branches - mov eax, [reg1]; cmp eax, [reg2]; jcc taken; fall through exit; taken exit
+            default: {
+                static const unsigned char conditions[] = {0x8C, 0x8E, 0x84, 0x85, 0x8F, 0x8D};
+                jitEmitRegisterOp(jit, 0x8B, instruction->reg1);
+                jitEmitRegisterOp(jit, 0x3B, instruction->reg2);
+                jitEmitByte(jit, 0x0F);
+                jitEmitByte(jit, conditions[instruction->opcode2]);
+                jitEmitWord(jit, JIT_EXIT_STUB_SIZE);
+                jitEmitExit(jit, pc + 4);
+                jitEmitExit(jit, instruction->target);
+                break;
+            }
+        }
+        pc += instruction->length;
+    }
+
+    //blocks that don't end in a branch fall through to the next instruction
+    DecodedInstruction *tail = fetchDecoded(vm, last);
+    if(tail->opcode != 7) {
+        jitEmitExit(jit, end);
+    }
+
+    //bail - mov rax, (1 << 32) | start; ret
+    if(bail != NULL) {
+        int offset = (int)((jit->buffer + jit->used) - (bail + 4));
+        memcpy(bail, &offset, 4);
+        jitEmitByte(jit, 0x48);
+        jitEmitByte(jit, 0xB8);
+        jitEmitWord(jit, start);
+        jitEmitWord(jit, 1);
+        jitEmitByte(jit, 0xC3);
+    }
+
+    //patch any exits that were waiting for this block
+    for(int i = 0; i < jit->pendingCount; i++) {
+        if(jit->pendingExits[i].target == start) {
+            jitPatchJump(jit->pendingExits[i].stub, code);
+            jit->pendingExits[i] = jit->pendingExits[--jit->pendingCount];
+            i--;
+        }
+    }
+
+    if(start < jit->codeLow) {
+        jit->codeLow = start;
+    }
+    if(end + 3 > jit->codeHigh) {
+        jit->codeHigh = end + 3;
+    }
+    return code;
+}
+
+//jitInvalidate - called for every write into virtual memory, throws the compiled code away if the
+//4 bytes at loc overlap any instruction that was compiled. Like the write, loc wraps around memory, and
+//a write that wraps past the top of memory is taken to overlap whatever sits at the bottom.
+void jitInvalidate(SiaVM *vm, unsigned int loc) {
+    JitState *jit = vm->jit;
+    loc &= vm->memoryMask;
+    if(jit != NULL && ((loc + 4ULL > jit->codeLow && loc < jit->codeHigh) || loc + 4ULL > vm->memoryMask + 1ULL)) {
+        jitFlush(jit);
+    }
+}
+
+//runJit - the JIT dispatcher. Runs compiled blocks and interprets whatever can't be compiled until halt.
+void runJit(SiaVM *vm) {
+    JitState *jit = calloc(1, sizeof(JitState));
+    if(jit == NULL) {
+        runFast(vm, ULLONG_MAX);
+        return;
+    }
+    jit->pageCount = codePageCount(vm);
+    jit->pageRecords = codePageRecords(vm);
+    jit->blockPages = calloc(jit->pageCount, sizeof(unsigned char **));
+    jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(jit->blockPages == NULL || jit->buffer == MAP_FAILED) {
+        vmPrint(vm, "Unable to allocate JIT code buffer, using --fast\n");
+        if(jit->buffer != MAP_FAILED) {
+            munmap(jit->buffer, JIT_BUFFER_SIZE);
+        }
+        free(jit->blockPages);
+        free(jit);
+        runFast(vm, ULLONG_MAX);
+        return;
+    }
+    jitFlush(jit);
+    vm->jit = jit;
+
+    //a SIAF binary lists where its blocks start, so they are compiled before the program runs
+    for(unsigned int i = 0; i < vm->blockCount; i++) {
+        unsigned int pc = bigEndianWord(vm->blocks + 8 * i);
+        if((bigEndianWord(vm->blocks + 8 * i + 4) & FAT_BLOCK_START) && pc + 4ULL <= vm->memorySize) {
+            unsigned char **block = jitBlock(jit, pc, 1);
+            if(*block == NULL) {
+                *block = jitCompileBlock(vm, pc);
+            }
+        }
+    }
+
+    while(!vm->halt) {
+        //code running off the end of memory wraps around, which only the interpreter handles
+        unsigned char *code = JIT_NO_BLOCK;
+        if(vm->PC + 4ULL <= vm->memorySize) {
+            unsigned char **block = jitBlock(jit, vm->PC, 1);
+            if(*block == NULL) {
+                *block = jitCompileBlock(vm, vm->PC);
+            }
+            code = *block;
+        }
+
+        if(code == JIT_NO_BLOCK) {
+            runFast(vm, 1);
+            continue;
+        }
+
+        unsigned long long next = ((JitBlockFunction)code)(vm->registers);
+        vm->PC = (unsigned int)next;
+        if(next >> 32) {
+            runFast(vm, 1);
+        }
+    }
+
+    jitRelease(vm);
+}
+
+//jitRelease - frees the VM's compiled code, if it has any
+void jitRelease(SiaVM *vm) {
+    JitState *jit = vm->jit;
+    if(jit == NULL) {
+        return;
+    }
+    vm->jit = NULL;
+    munmap(jit->buffer, JIT_BUFFER_SIZE);
+    for(unsigned int i = 0; i < jit->pageCount; i++) {
+        free(jit->blockPages[i]);
+    }
+    free(jit->blockPages);
+    free(jit);
+}
+
+#else
+
+void jitInvalidate(SiaVM *vm, unsigned int loc) {
+}
+
+void jitRelease(SiaVM *vm) {
+}
+
+//runJit - no code generator for this host, fall back to the fast engine
+void runJit(SiaVM *vm) {
+    vmPrint(vm, "JIT is only available on x86-64 Linux, using --fast\n");
+    runFast(vm, ULLONG_MAX);
+}
+
+#endif
+
+/////////////////////////
+// Lockstep Lane Engine //
+/////////////////////////
+// --lanes runs up to LANES copies of one program side by side, one per input image, with the register
+// files laid out structure of arrays: registers[r] holds register r of every lane in one vector. While
+// lanes share a PC, 3R arithmetic (except divide), move, branches, call and jump run as one vector
+// operation for all of them. Everything else (memory, stack, interrupt, divide, halt) is run by the fast
+// engine one lane at a time, on that lane's own SiaVM, which also holds its memory and output.
+//
+// Lanes that branch different ways split up. Each step only runs the lanes sitting at the lowest PC, so
+// the lanes that fell behind catch up and the group joins back together where the paths meet again, at
+// the end of an if or after the last pass of a loop. Each lane still runs exactly its own program, only
+// the interleaving between lanes changes. Instructions whose bytes differ between lanes, because an
+// input was loaded over them or a store wrote into them, always run one lane at a time.
+//
+// Vectors use GCC/Clang vector extensions. LANES is 16 when built for AVX-512 and 8 otherwise, build with
+// -mavx2 (or -march=native) so a lane vector fits in one register.
+
+#if defined(__AVX512F__)
+#define LANES 16
+#else
+#define LANES 8
+#endif
+
+typedef int LaneVector __attribute__((vector_size(LANES * sizeof(int))));
+typedef unsigned int LaneAddresses __attribute__((vector_size(LANES * sizeof(int))));
+
+//one group of lanes running the same program
+typedef struct LaneGroup {
+    LaneVector registers[16];           //registers[r][lane]
+    LaneAddresses pc;                   //program counter of each lane
+    LaneVector live;                    //-1 for lanes still running, 0 once halted
+    SiaVM *vms[LANES];                  //memory, decode cache and output of each lane
+    unsigned int codeLimit;             //PCs from here on always run one lane at a time
+    unsigned char divergentCode[LANE_CODE_LIMIT];   //PCs whose instruction bytes may differ between lanes
+} LaneGroup;
+
+//laneBits - one bit per lane of mask that is set. Vectors are passed by pointer, passing them by value
+//depends on which vector extensions the compiler was told it can use.
+unsigned int laneBits(LaneVector *mask) {
+    unsigned int bits = 0;
+    for(int i = 0; i < LANES; i++) {
+        bits |= (unsigned int)((*mask)[i] & 1) << i;
+    }
+    return bits;
+}
+
+//laneStackLimit - the lowest stack pointer of the active lanes, as fetch compares it
+unsigned int laneStackLimit(LaneGroup *group, LaneVector *active) {
+    unsigned int limit = UINT_MAX;
+    for(int i = 0; i < LANES; i++) {
+        if((*active)[i] && (unsigned int)group->registers[15][i] < limit) {
+            limit = group->registers[15][i];
+        }
+    }
+    return limit;
+}
+
+//laneWrite - writes value into register reg of the active lanes only
+void laneWrite(LaneGroup *group, unsigned char reg, LaneVector *value, LaneVector *active) {
+    group->registers[reg] = (*value & *active) | (group->registers[reg] & ~*active);
+}
+
+//laneSync - copies lane i's registers and PC into its SiaVM, or back out of it
+void laneSync(LaneGroup *group, int i, bool toVM) {
+    SiaVM *vm = group->vms[i];
+    for(int r = 0; r < 16; r++) {
+        if(toVM) {
+            vm->registers[r] = group->registers[r][i];
+        }
+        else {
+            group->registers[r][i] = vm->registers[r];
+        }
+    }
+    if(toVM) {
+        vm->PC = group->pc[i];
+    }
+    else {
+        group->pc[i] = vm->PC;
+        group->live[i] = vm->halt ? 0 : -1;
+    }
+}
+
+//runLanes - runs count VMs, all loaded with the same program, in lockstep until every one has halted
+void runLanes(SiaVM **vms, int count) {
+    LaneGroup group;
+    memset(&group, 0, sizeof(group));
+    group.pc = (LaneAddresses){0} + UINT_MAX;
+    if(count > 0) {
+        group.codeLimit = (vms[0]->memoryMask < LANE_CODE_LIMIT) ? vms[0]->memoryMask + 1 : LANE_CODE_LIMIT;
+    }
+    for(int i = 0; i < count && i < LANES; i++) {
+        group.vms[i] = vms[i];
+        laneSync(&group, i, 0);
+        vms[i]->divergentCode = group.divergentCode;
+
+        //every instruction covering a byte that differs from the first lane is divergent
+        for(unsigned int loc = 0; i > 0 && loc < group.codeLimit; loc++) {
+            if(vms[i]->virtualMemory[loc] != vms[0]->virtualMemory[loc]) {
+                for(unsigned int pc = (loc >= 3 ? loc - 3 : 0); pc <= loc; pc++) {
+                    group.divergentCode[pc] = 1;
+                }
+            }
+        }
+    }
+
+    //converged - every live lane is at pc and active. Otherwise active and pc are picked again each step.
+    //While converged the active lanes' entries in group.pc are stale, pc is the PC of every one of them.
+    bool converged = 0;
+    unsigned int pc = 0;
+    int leader = 0;
+    unsigned int stackLimit = 0;
+    LaneVector active = group.live;
+    unsigned int activeBits = 0;
+    for(;;) {
+        if(!converged) {
+            pc = UINT_MAX;
+            for(int i = 0; i < LANES; i++) {
+                if(group.live[i] && group.pc[i] < pc) {
+                    pc = group.pc[i];
+                    leader = i;
+                }
+            }
+            if(pc == UINT_MAX) {
+                break;
+            }
+            active = group.live & (LaneVector)(group.pc == pc);
+            activeBits = laneBits(&active);
+            converged = activeBits == laneBits(&group.live);
+            stackLimit = laneStackLimit(&group, &active);
+        }
+
+        //instructions the vector path can't run go through the fast engine lane by lane
+        DecodedInstruction *instruction = NULL;
+        if(pc + 4 <= group.codeLimit && !group.divergentCode[pc]) {
+            instruction = fetchDecoded(group.vms[leader], pc);
+        }
+        if(instruction == NULL || instruction->handler == HANDLER_DIVIDE || instruction->handler == HANDLER_HALT
+            || (instruction->handler > HANDLER_JUMP && instruction->handler != HANDLER_MOVE)) {
+            for(int i = 0; i < LANES; i++) {
+                if(active[i]) {
+                    group.pc[i] = pc;
+                    laneSync(&group, i, 1);
+                    runFast(group.vms[i], 1);
+                    laneSync(&group, i, 0);
+                }
+            }
+            converged = 0;
+            continue;
+        }
+
+        //same check as fetch, for every active lane at once
+        if(pc + 4 >= stackLimit) {
+            for(int i = 0; i < LANES; i++) {
+                if(active[i] && pc + 4 >= (unsigned int)group.registers[15][i]) {
+                    group.pc[i] = pc;
+                    laneSync(&group, i, 1);
+                    stackCollision(group.vms[i], pc);
+                    group.live[i] = 0;
+                }
+            }
+            converged = 0;
+            continue;
+        }
+
+        LaneVector a = group.registers[instruction->reg1];
+        LaneVector b = group.registers[instruction->reg2];
+        LaneVector result;
+        LaneVector taken = active;
+        unsigned char destination = instruction->reg3;
+        switch(instruction->handler) {
+            //3R and move - write the result of every active lane
+            case HANDLER_ADD:
+                result = a + b;
+                break;
+            case HANDLER_AND:
+                result = a & b;
+                break;
+            case HANDLER_MULTIPLY:
+                result = a * b;
+                break;
+            case HANDLER_SUBTRACT:
+                result = a - b;
+                break;
+            case HANDLER_OR:
+                result = a | b;
+                break;
+            case HANDLER_MOVE:
+                result = (LaneVector){0} + instruction->immediate;
+                destination = instruction->reg1;
+                break;
+
+            //branches - each active lane goes to the target or the next instruction on its own compare
+            case HANDLER_BRANCHIFLESS:
+                taken = a < b;
+                break;
+            case HANDLER_BRANCHIFLESSOREQUAL:
+                taken = a <= b;
+                break;
+            case HANDLER_BRANCHIFEQUAL:
+                taken = a == b;
+                break;
+            case HANDLER_BRANCHIFNOTEQUAL:
+                taken = a != b;
+                break;
+            case HANDLER_BRANCHIFGREATER:
+                taken = a > b;
+                break;
+            case HANDLER_BRANCHIFGREATEROREQUAL:
+                taken = a >= b;
+                break;
+            //call and jump are always taken
+        }
+
+        if(instruction->handler < HANDLER_BRANCHIFLESS || instruction->handler == HANDLER_MOVE) {
+            //lanes that have halted already hold their final registers in their SiaVM
+            if(converged) {
+                group.registers[destination] = result;
+            }
+            else {
+                laneWrite(&group, destination, &result, &active);
+            }
+            if(destination == 15) {
+                stackLimit = laneStackLimit(&group, &active);
+            }
+            pc += 2;
+        }
+        else {
+            //branch - lanes that disagree split the group, the rest carry on together
+            taken &= active;
+            unsigned int takenBits = laneBits(&taken);
+            if(takenBits != 0 && takenBits != activeBits) {
+                LaneVector target = (LaneVector){0} + (int)instruction->target;
+                LaneVector next = (LaneVector){0} + (int)(pc + instruction->length);
+                group.pc = (LaneAddresses)((target & taken) | (next & active & ~taken) | ((LaneVector)group.pc & ~active));
+                converged = 0;
+                continue;
+            }
+            pc = (takenBits != 0) ? instruction->target : pc + instruction->length;
+        }
+
+        //only a converged group can leave the active lanes' PCs for later
+        if(!converged) {
+            group.pc = (LaneAddresses)(((LaneVector){0} + (int)pc) & active) | (group.pc & (LaneAddresses)~active);
+        }
+    }
+
+    for(int i = 0; i < count && i < LANES; i++) {
+        vms[i]->divergentCode = NULL;
+    }
+}
+
+
+
+//////////////
+// Profiler //
+//////////////
+// --profile counts how often every PC and every basic block runs, and builds a call tree by following
+// call and return instructions. It steps the fast engine one instruction at a time, so it is slow but
+// exact. --profile-hz samples the PC of a VM running on any engine from a SIGPROF interval timer instead,
+// which costs next to nothing but gives no call tree.
+// Both write the call stacks collapsed, one "frame;frame;frame count" line each, the format flamegraph
+// tools take, and print the hottest PCs, blocks and call edges to stderr.
+
+#include <signal.h>
+#include <sys/time.h>
+
+#define PROFILE_TOP 20                  //lines in each table of the report
+#define PROFILE_RING_SIZE (1 << 20)     //samples kept, older ones are overwritten
+#define PROFILE_BLOCK_LIMIT 256         //longest basic block the report walks
+
+//CallNode - one function in the call tree, per path of calls that reached it
+typedef struct CallNode {
+    unsigned int function;      //entry PC, the call target. The root is the program's entry
+    int parent;                 //-1 for the root
+    unsigned long long calls;   //times it was called from its parent
+    unsigned long long count;   //instructions run (or samples taken) in it, not counting callees
+} CallNode;
+
+struct Profile {
+    unsigned long long **pcPages;       //executions per PC, in pages of CODE_PAGE_SIZE
+    unsigned long long **blockPages;    //executions per basic block, by its first PC
+    unsigned long long total;           //instructions run or samples taken
+    bool sampled;                       //counted by --profile-hz, no blocks or call tree
+    CallNode *nodes;
+    int nodeCount;
+    int nodeCapacity;
+    int *children;                      //hash of (parent, function) to node index, -1 when empty
+    int childrenSize;                   //a power of two, kept at least twice nodeCount
+    int current;                        //node of the function running now
+};
+
+//profileCounter - the counter for pc in a table of pages, allocating its page if needed
+unsigned long long *profileCounter(SiaVM *vm, unsigned long long **pages, unsigned int pc) {
+    unsigned long long **page = &pages[pc >> CODE_PAGE_BITS];
+    if(*page == NULL) {
+        *page = calloc(CODE_PAGE_SIZE, sizeof(unsigned long long));
+        if(*page == NULL) {
+            fprintf(stderr, "out of memory for the profile\n");
+            exit(1);
+        }
+    }
+    return &(*page)[pc & (CODE_PAGE_SIZE - 1)];
+}
+
+//childSlot - hash slot of the child of parent for function, or of the empty slot it would go in
+int childSlot(Profile *profile, int parent, unsigned int function) {
+    unsigned int hash = ((unsigned int)parent * 2654435761u) ^ (function * 40503u);
+    int mask = profile->childrenSize - 1;
+    for(int slot = hash & mask; ; slot = (slot + 1) & mask) {
+        int node = profile->children[slot];
+        if(node < 0 || (profile->nodes[node].parent == parent && profile->nodes[node].function == function)) {
+            return slot;
+        }
+    }
+}
+
+//enterFunction - moves the call tree down into function, called from the current node
+void enterFunction(Profile *profile, unsigned int function) {
+    int slot = childSlot(profile, profile->current, function);
+    if(profile->children[slot] < 0) {
+        if(profile->nodeCount == profile->nodeCapacity) {
+            profile->nodeCapacity *= 2;
+            profile->nodes = realloc(profile->nodes, profile->nodeCapacity * sizeof(CallNode));
+        }
+        //grow the hash when it is half full, and put every node back in
+        if(profile->nodeCount * 2 >= profile->childrenSize) {
+            profile->childrenSize *= 2;
+            profile->children = realloc(profile->children, profile->childrenSize * sizeof(int));
+            memset(profile->children, -1, profile->childrenSize * sizeof(int));
+            for(int i = 1; i < profile->nodeCount; i++) {
+                profile->children[childSlot(profile, profile->nodes[i].parent, profile->nodes[i].function)] = i;
+            }
+            slot = childSlot(profile, profile->current, function);
+        }
+        CallNode *node = &profile->nodes[profile->nodeCount];
+        node->function = function;
+        node->parent = profile->current;
+        node->calls = 0;
+        node->count = 0;
+        profile->children[slot] = profile->nodeCount++;
+    }
+    profile->current = profile->children[slot];
+    profile->nodes[profile->current].calls++;
+}
+
+//createProfile - an empty profile for vm, with the call tree rooted at its entry PC
+Profile *createProfile(SiaVM *vm) {
+    Profile *profile = calloc(1, sizeof(Profile));
+    profile->pcPages = calloc(codePageCount(vm), sizeof(unsigned long long *));
+    profile->blockPages = calloc(codePageCount(vm), sizeof(unsigned long long *));
+    profile->nodeCapacity = 64;
+    profile->nodes = calloc(profile->nodeCapacity, sizeof(CallNode));
+    profile->childrenSize = 128;
+    profile->children = malloc(profile->childrenSize * sizeof(int));
+    if(profile->pcPages == NULL || profile->blockPages == NULL || profile->nodes == NULL || profile->children == NULL) {
+        fprintf(stderr, "out of memory for the profile\n");
+        exit(1);
+    }
+    memset(profile->children, -1, profile->childrenSize * sizeof(int));
+    profile->nodes[0].function = vm->PC;
+    profile->nodes[0].parent = -1;
+    profile->nodeCount = 1;
+    return profile;
+}
+
+//destroyProfile - frees a profile
+void destroyProfile(SiaVM *vm, Profile *profile) {
+    for(unsigned int i = 0; i < codePageCount(vm); i++) {
+        free(profile->pcPages[i]);
+        free(profile->blockPages[i]);
+    }
+    free(profile->pcPages);
+    free(profile->blockPages);
+    free(profile->nodes);
+    free(profile->children);
+    free(profile);
+}
+
+//runProfiled - runs vm to halt on the fast engine, one instruction at a time, counting every PC, every
+//basic block and every call and return into vm->profile
+void runProfiled(SiaVM *vm) {
+    Profile *profile = vm->profile;
+    bool leader = 1;
+    while(!vm->halt) {
+        unsigned int pc = vm->PC & vm->memoryMask;
+        DecodedInstruction *instruction = fetchDecoded(vm, pc);
+        unsigned char flags = isaFlags(instruction);
+
+        (*profileCounter(vm, profile->pcPages, pc))++;
+        if(leader) {
+            (*profileCounter(vm, profile->blockPages, pc))++;
+        }
+        profile->nodes[profile->current].count++;
+        profile->total++;
+        runFast(vm, 1);
+
+        //every branch, call, jump and return ends a block, taken or not
+        leader = (flags & ISA_CONTROL) != 0;
+        if(flags & ISA_CALL) {
+            enterFunction(profile, vm->PC);
+        }
+        else if((flags & ISA_RETURN) && profile->current != 0) {
+            profile->current = profile->nodes[profile->current].parent;
+        }
+    }
+}
+
+//sampler state, one VM at a time since SIGPROF is per process
+SiaVM *volatile sampledVM;
+unsigned int *sampleRing;
+volatile unsigned long long sampleCount;
+
+//profileSample - SIGPROF handler, records the running VM's PC
+void profileSample(int number) {
+    SiaVM *vm = sampledVM;
+    if(vm != NULL) {
+        sampleRing[sampleCount++ % PROFILE_RING_SIZE] = vm->PC;
+    }
+}
+
+//startSampling - samples vm's PC hz times per second of CPU time until stopSampling
+void startSampling(SiaVM *vm, int hz) {
+    sampleRing = malloc(PROFILE_RING_SIZE * sizeof(unsigned int));
+    if(sampleRing == NULL) {
+        fprintf(stderr, "out of memory for the profile\n");
+        exit(1);
+    }
+    sampleCount = 0;
+    sampledVM = vm;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profileSample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = (hz >= 1000000) ? 1 : 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+//stopSampling - stops the timer and counts the samples taken into vm->profile, all in the root node
+void stopSampling(SiaVM *vm) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sampledVM = NULL;
+
+    Profile *profile = vm->profile;
+    unsigned long long count = (sampleCount < PROFILE_RING_SIZE) ? sampleCount : PROFILE_RING_SIZE;
+    for(unsigned long long i = 0; i < count; i++) {
+        (*profileCounter(vm, profile->pcPages, sampleRing[i] & vm->memoryMask))++;
+    }
+    profile->nodes[0].count = count;
+    profile->total = count;
+    profile->sampled = 1;
+    free(sampleRing);
+    sampleRing = NULL;
+}
+
+//ProfileLine - one line of a report table
+typedef struct ProfileLine {
+    unsigned int pc;
+    unsigned long long count;
+} ProfileLine;
+
+//compareProfileLines - qsort order for report lines, highest count first
+int compareProfileLines(const void *a, const void *b) {
+    unsigned long long countA = ((const ProfileLine *)a)->count;
+    unsigned long long countB = ((const ProfileLine *)b)->count;
+    return (countA < countB) - (countA > countB);
+}
+
+//hottest - collects the PCs counted in pages, highest count first. Returns how many there are.
+int hottest(SiaVM *vm, unsigned long long **pages, ProfileLine **lines) {
+    int count = 0;
+    int capacity = 64;
+    *lines = malloc(capacity * sizeof(ProfileLine));
+    for(unsigned int page = 0; page < codePageCount(vm); page++) {
+        for(unsigned int i = 0; pages[page] != NULL && i < CODE_PAGE_SIZE; i++) {
+            if(pages[page][i] == 0) {
+                continue;
+            }
+            if(count == capacity) {
+                capacity *= 2;
+                *lines = realloc(*lines, capacity * sizeof(ProfileLine));
+            }
+            (*lines)[count].pc = (page << CODE_PAGE_BITS) | i;
+            (*lines)[count++].count = pages[page][i];
+        }
+    }
+    qsort(*lines, count, sizeof(ProfileLine), compareProfileLines);
+    return count;
+}
+
+//writeStack - writes the collapsed call stack of node, root first
+void writeStack(Profile *profile, int node, FILE *out) {
+    if(profile->nodes[node].parent >= 0) {
+        writeStack(profile, profile->nodes[node].parent, out);
+        fprintf(out, ";");
+    }
+    fprintf(out, "%s_0x%x", node == 0 ? "main" : "f", profile->nodes[node].function);
+}
+
+//writeProfile - writes the collapsed stacks to filename and the report to stderr
+void writeProfile(SiaVM *vm, char *filename) {
+    Profile *profile = vm->profile;
+    FILE *out = fopen(filename, "w");
+    if(out == NULL) {
+        fprintf(stderr, "unable to open profile file\n");
+    }
+    else {
+        if(profile->sampled) {
+            //samples have no call tree, every PC is a frame of its own
+            ProfileLine *lines;
+            int count = hottest(vm, profile->pcPages, &lines);
+            for(int i = 0; i < count; i++) {
+                fprintf(out, "main_0x%x;pc_0x%x %llu\n", profile->nodes[0].function, lines[i].pc, lines[i].count);
+            }
+            free(lines);
+        }
+        for(int i = 0; i < profile->nodeCount; i++) {
+            if(profile->nodes[i].count != 0 && !profile->sampled) {
+                writeStack(profile, i, out);
+                fprintf(out, " %llu\n", profile->nodes[i].count);
+            }
+        }
+        fclose(out);
+    }
+
+    double total = profile->total ? (double)profile->total : 1.0;
+    fprintf(stderr, "Profile: %llu %s\n", profile->total, profile->sampled ? "samples" : "instructions");
+    ProfileLine *lines;
+    int count = hottest(vm, profile->pcPages, &lines);
+    fprintf(stderr, "Hottest PCs: \n");
+    for(int i = 0; i < count && i < PROFILE_TOP; i++) {
+        DecodedInstruction *instruction = fetchDecoded(vm, lines[i].pc);
+        fprintf(stderr, "0x%08x %-24s %12llu %5.1f%%\n", lines[i].pc, handlerNames[instruction->handler],
+            lines[i].count, 100.0 * lines[i].count / total);
+    }
+    free(lines);
+
+    if(!profile->sampled) {
+        count = hottest(vm, profile->blockPages, &lines);
+        fprintf(stderr, "Hottest blocks: \n");
+        for(int i = 0; i < count && i < PROFILE_TOP; i++) {
+            //a block runs up to the first branch, call, jump, return or halt
+            unsigned int end = lines[i].pc;
+            for(int length = 1; length < PROFILE_BLOCK_LIMIT; length++) {
+                DecodedInstruction *instruction = fetchDecoded(vm, end);
+                if(instruction->handler == HANDLER_HALT || instruction->handler == HANDLER_ILLEGAL
+                        || (isaFlags(instruction) & ISA_CONTROL)) {
+                    break;
+                }
+                end += instruction->length;
+            }
+            fprintf(stderr, "0x%08x-0x%08x %12llu runs\n", lines[i].pc, end, lines[i].count);
+        }
+        free(lines);
+
+        //call edges, one per path through the call tree, most called first
+        lines = malloc(profile->nodeCount * sizeof(ProfileLine));
+        for(int i = 0; i < profile->nodeCount; i++) {
+            lines[i].pc = i;
+            lines[i].count = profile->nodes[i].calls;
+        }
+        qsort(lines, profile->nodeCount, sizeof(ProfileLine), compareProfileLines);
+        fprintf(stderr, "Call edges: \n");
+        for(int i = 0; i < profile->nodeCount - 1 && i < PROFILE_TOP; i++) {
+            CallNode *node = &profile->nodes[lines[i].pc];
+            fprintf(stderr, "0x%08x -> 0x%08x %12llu calls\n", profile->nodes[node->parent].function, node->function, node->calls);
+        }
+        free(lines);
+    }
+}
+
+
+
+/////////////////////
+// Cache Simulator //
+/////////////////////
+// --icache and --dcache put a set-associative L1 cache model in front of memory for the pipeline model.
+// Fetch looks up the instruction cache, and loads, stores, pushes, pops and returns the data cache.
+// The caches only keep tags, memory is still read and written directly. Every line missed adds
+// --miss-penalty cycles to the cycle count, and --stats reports each cache's hit rate and the PCs of
+// the instructions that missed the most, to see what a data layout costs before it reaches hardware.
+
+#define DEFAULT_MISS_PENALTY 10
+
+//Cache - one cache's shape, tags and counts
+struct Cache {
+    unsigned int size;          //bytes
+    unsigned int ways;          //lines per set
+    unsigned int lineSize;      //bytes, a power of two
+    unsigned int sets;          //a power of two
+    int replacement;            //REPLACE_LRU or REPLACE_RANDOM
+    unsigned int missPenalty;   //cycles added for each line missed
+    unsigned int *tags;         //line number + 1 held by each way, 0 when empty, ways per set
+    unsigned long long *used;   //access each way was last used on, for LRU
+    unsigned long long accesses;
+    unsigned long long misses;
+    unsigned int seed;          //random replacement state
+    unsigned long long **accessPages;   //accesses by the PC of the instruction making them
+    unsigned long long **missPages;     //lines missed by the PC of the instruction making them
+};
+
+//createCache - allocates an empty cache shaped like shape for vm, returns NULL if out of memory
+Cache *createCache(SiaVM *vm, Cache *shape) {
+    Cache *cache = malloc(sizeof(Cache));
+    if(cache == NULL) {
+        return NULL;
+    }
+    *cache = *shape;
+    cache->tags = calloc((size_t)cache->sets * cache->ways, sizeof(unsigned int));
+    cache->used = calloc((size_t)cache->sets * cache->ways, sizeof(unsigned long long));
+    cache->accessPages = calloc(codePageCount(vm), sizeof(unsigned long long *));
+    cache->missPages = calloc(codePageCount(vm), sizeof(unsigned long long *));
+    cache->accesses = 0;
+    cache->misses = 0;
+    cache->seed = 2463534242u;
+    if(cache->tags == NULL || cache->used == NULL || cache->accessPages == NULL || cache->missPages == NULL) {
+        free(cache->tags);
+        free(cache->used);
+        free(cache->accessPages);
+        free(cache->missPages);
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+//destroyCache - frees a cache from createCache
+void destroyCache(SiaVM *vm, Cache *cache) {
+    if(cache == NULL) {
+        return;
+    }
+    for(unsigned int i = 0; i < codePageCount(vm); i++) {
+        free(cache->accessPages[i]);
+        free(cache->missPages[i]);
+    }
+    free(cache->accessPages);
+    free(cache->missPages);
+    free(cache->tags);
+    free(cache->used);
+    free(cache);
+}
+
+//cacheLookup - looks up line, the line number of an address, and returns whether it was in the cache.
+//A miss brings it in, over an empty way if there is one, else over the least recently used way or a
+//random one.
+bool cacheLookup(Cache *cache, unsigned int line) {
+    unsigned int set = line & (cache->sets - 1);
+    unsigned int *tags = &cache->tags[set * cache->ways];
+    unsigned long long *used = &cache->used[set * cache->ways];
+    unsigned int victim = 0;
+    for(unsigned int way = 0; way < cache->ways; way++) {
+        if(tags[way] == line + 1) {
+            used[way] = cache->accesses;
+            return 1;
+        }
+        if(tags[victim] != 0 && (tags[way] == 0 || used[way] < used[victim])) {
+            victim = way;
+        }
+    }
+    if(tags[victim] != 0 && cache->replacement == REPLACE_RANDOM) {
+        //xorshift32
+        cache->seed ^= cache->seed << 13;
+        cache->seed ^= cache->seed >> 17;
+        cache->seed ^= cache->seed << 5;
+        victim = cache->seed % cache->ways;
+    }
+    tags[victim] = line + 1;
+    used[victim] = cache->accesses;
+    return 0;
+}
+
+//cacheAccess - the instruction at pc reads or writes length bytes at address. Every line they touch is
+//looked up, and every line missed adds the miss penalty to the cycle count.
+void cacheAccess(SiaVM *vm, Cache *cache, unsigned int pc, unsigned int address, unsigned int length) {
+    pc &= vm->memoryMask;
+    address &= vm->memoryMask;
+    unsigned int first = address / cache->lineSize;
+    unsigned int last = ((address + length - 1) & vm->memoryMask) / cache->lineSize;
+    cache->accesses++;
+    (*profileCounter(vm, cache->accessPages, pc))++;
+    for(unsigned int line = first; ; line = (line + 1) & (vm->memoryMask / cache->lineSize)) {
+        if(!cacheLookup(cache, line)) {
+            cache->misses++;
+            (*profileCounter(vm, cache->missPages, pc))++;
+            vm->cycle += cache->missPenalty;
+        }
+        if(line == last) {
+            break;
+        }
+    }
+}
+
+//reportCache - prints a cache's hit rate and the PCs with the most misses, as text or as the members of
+//a JSON object
+void reportCache(SiaVM *vm, Cache *cache, const char *name, FILE *out, bool json) {
+    char *replacements[] = {"lru", "random"};
+    unsigned long long hits = cache->accesses - cache->misses;
+    double rate = cache->accesses ? 100.0 * hits / cache->accesses : 100.0;
+    ProfileLine *lines;
+    int count = hottest(vm, cache->missPages, &lines);
+    if(count > PROFILE_TOP) {
+        count = PROFILE_TOP;
+    }
+    if(json) {
+        fprintf(out, "\"%s\": {\"size\": %u, \"ways\": %u, \"line\": %u, \"replacement\": \"%s\", \"accesses\": %llu, "
+            "\"hits\": %llu, \"misses\": %llu, \"hitRate\": %.1f, \"pcs\": [",
+            name, cache->size, cache->ways, cache->lineSize, replacements[cache->replacement], cache->accesses,
+            hits, cache->misses, rate);
+        for(int i = 0; i < count; i++) {
+            fprintf(out, "%s{\"pc\": %u, \"accesses\": %llu, \"misses\": %llu}", i ? ", " : "", lines[i].pc,
+                *profileCounter(vm, cache->accessPages, lines[i].pc), lines[i].count);
+        }
+        fprintf(out, "]}");
+        free(lines);
+        return;
+    }
+    fprintf(out, "%s: %u bytes, %u-way, %u byte lines, %s\n", name, cache->size, cache->ways, cache->lineSize,
+        replacements[cache->replacement]);
+    fprintf(out, "Accesses: %llu\nHits: %llu (%.1f%%)\nMisses: %llu\n", cache->accesses, hits, rate, cache->misses);
+    if(count > 0) {
+        fprintf(out, "Most misses: \n");
+    }
+    for(int i = 0; i < count; i++) {
+        unsigned long long accesses = *profileCounter(vm, cache->accessPages, lines[i].pc);
+        fprintf(out, "0x%08x %12llu accesses %12llu misses (%.1f%% hits)\n", lines[i].pc, accesses, lines[i].count,
+            100.0 * (accesses - lines[i].count) / accesses);
+    }
+    free(lines);
+}
+
+
+
+//////////////////
+// Trace Writer //
+//////////////////
+// --trace writes one binary record per instruction run: its PC and raw bytes, the register it wrote and
+// the value, and the memory word it wrote and where. Records go into a lock-free ring with one producer,
+// the VM, and one consumer, a thread that drains the ring to the trace file in large writes. SIATrace
+// decodes trace files and diffs two of them. The pipeline records each instruction as it is stored, the
+// other engines are stepped through the fast engine one instruction at a time.
+
+#define TRACE_RING_SIZE (1 << 16)   //records, a power of two
+
+struct TraceRing {
+    RingDrain drain;
+    TraceRecord records[TRACE_RING_SIZE];
+};
+
+//startTrace - opens filename and starts the drain thread for vm's trace, returns 0 if it can't
+bool startTrace(SiaVM *vm, char *filename) {
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    FILE *out = NULL;
+    if(ring == NULL || (out = fopen(filename, "wb")) == NULL) {
+        fprintf(stderr, "unable to open trace file\n");
+        free(ring);
+        return 0;
+    }
+    //the file starts with the magic and the size of a record
+    unsigned int recordSize = sizeof(TraceRecord);
+    fwrite(TRACE_MAGIC, 1, 4, out);
+    fwrite(&recordSize, sizeof(recordSize), 1, out);
+    if(!startDrain(&ring->drain, ring->records, sizeof(TraceRecord), TRACE_RING_SIZE, out, 0)) {
+        fprintf(stderr, "unable to start trace thread\n");
+        fclose(out);
+        free(ring);
+        return 0;
+    }
+    vm->trace = ring;
+    return 1;
+}
+
+//stopTrace - waits for the drain thread to write everything out and closes the trace
+void stopTrace(SiaVM *vm) {
+    TraceRing *ring = vm->trace;
+    stopDrain(&ring->drain);
+    fclose(ring->drain.out);
+    free(ring);
+    vm->trace = NULL;
+}
+
+//fillTraceRecord - fills in record for the instruction at pc that has just run. address is where a store
+//wrote, worked out before it ran since the store can change its own address register.
+void fillTraceRecord(SiaVM *vm, TraceRecord *record, unsigned int pc, DecodedInstruction *instruction, unsigned int address) {
+    memset(record, 0, sizeof(TraceRecord));
+    record->pc = pc;
+    for(int i = 0; i < 4; i++) {
+        record->bytes[i] = vm->virtualMemory[(pc + i) & vm->memoryMask];
+    }
+    record->reg = TRACE_NO_REGISTER;
+    switch(instruction->handler) {
+        case HANDLER_ADD: case HANDLER_AND: case HANDLER_DIVIDE: case HANDLER_MULTIPLY: case HANDLER_SUBTRACT: case HANDLER_OR:
+            record->reg = instruction->reg3;
+            break;
+        case HANDLER_LOAD: case HANDLER_POP: case HANDLER_MOVE:
+            record->reg = instruction->reg1;
+            break;
+        case HANDLER_RETURN:
+            record->reg = 15;
+            break;
+        case HANDLER_PUSH:
+            record->reg = 15;
+            address = vm->registers[15];
+            record->wroteMemory = 1;
+            break;
+        case HANDLER_STORE:
+            record->wroteMemory = 1;
+            break;
+    }
+    if(record->reg != TRACE_NO_REGISTER) {
+        record->value = vm->registers[record->reg];
+    }
+    if(record->wroteMemory) {
+        record->address = address;
+        record->memoryValue = readWord(vm, address);
+    }
+}
+
+//writeTraceRecord - adds a filled in record to vm's trace
+void writeTraceRecord(SiaVM *vm, TraceRecord *record) {
+    TraceRing *ring = vm->trace;
+    unsigned long long head = ring->drain.head;
+    //the ring is full, wait for the drain thread to catch up
+    while(head - __atomic_load_n(&ring->drain.tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE) {
+        usleep(10);
+    }
+    ring->records[head & (TRACE_RING_SIZE - 1)] = *record;
+    __atomic_store_n(&ring->drain.head, head + 1, __ATOMIC_RELEASE);
+}
+
+//traceInstruction - records the instruction at pc that has just run, address as for fillTraceRecord
+void traceInstruction(SiaVM *vm, unsigned int pc, DecodedInstruction *instruction, unsigned int address) {
+    TraceRecord record;
+    fillTraceRecord(vm, &record, pc, instruction, address);
+    writeTraceRecord(vm, &record);
+}
+
+//runTraced - runs vm to halt on the fast engine one instruction at a time, tracing every instruction
+void runTraced(SiaVM *vm) {
+    while(!vm->halt) {
+        unsigned int pc = vm->PC & vm->memoryMask;
+        DecodedInstruction instruction = *fetchDecoded(vm, pc);
+        unsigned int address = vm->registers[instruction.reg2] + instruction.immediate;
+        runFast(vm, 1);
+        //a stack collision or illegal instruction stops the VM without running anything
+        if(vm->status == 0) {
+            traceInstruction(vm, pc, &instruction, address);
+        }
+    }
+}
+
+
+
+///////////////////////
+// Threaded Pipeline //
+///////////////////////
+// --threaded runs the four pipeline stages at once, each on its own host thread pinned to a core,
+// passing instructions down lock-free queues with one producer and one consumer. Fetch runs ahead on
+// its own static predictor and return address stack. Execute owns a copy of the VM sharing its memory
+// and runs each instruction through the fast engine. A mispredicted branch, or a store into code fetch
+// has already read, bumps the fetch generation and sends fetch back to the right PC, and every stage
+// drops instructions from an older generation. Store commits the registers in program order and keeps
+// the pipeline model's statistics exactly as runPipeline does, so --stats and --trace match the
+// sequential pipeline. Passing each instruction between threads costs more than most stages do, so it
+// can only pay with a core for each stage and real work in the stages, like writing a trace. It has
+// not been measured beating the sequential pipeline.
+
+#include <sched.h>
+
+#define STAGE_QUEUE_SIZE 64     //instructions between two stages, a power of two
+#define STAGE_SPINS 64          //times a stage polls an empty or full queue before yielding its core
+
+//StageItem - one instruction on its way through the threaded pipeline
+typedef struct StageItem {
+    DecodedInstruction instruction;
+    unsigned int pc;
+    unsigned int predicted;     //where fetch went after it
+    unsigned int next;          //where it really went, from execute
+    unsigned int generation;    //the fetch generation it was fetched in
+    bool retire;                //it ran, false for a stack collision found before it could
+    bool stop;                  //the last instruction, the pipeline finishes with it
+    int registers[16];          //registers after it ran
+    TraceRecord record;         //under --trace, filled in by execute and written by store
+} StageItem;
+
+//StageQueue - a lock-free queue between two stages. head and tail sit on their own cache lines so the
+//two threads don't pass one line back and forth.
+typedef struct StageQueue {
+    StageItem items[STAGE_QUEUE_SIZE];
+    _Alignas(64) unsigned long long head;   //items pushed, only the producer stores it
+    _Alignas(64) unsigned long long tail;   //items popped, only the consumer stores it
+} StageQueue;
+
+typedef struct ThreadedPipeline {
+    SiaVM *vm;              //the VM, its registers and statistics kept by the store stage
+    SiaVM exec;             //execute's copy of the VM, ahead of store, sharing its memory
+    SiaVM speculation;      //fetch's predictor
+    StageQueue fetched;
+    StageQueue decoded;
+    StageQueue executed;
+    _Alignas(64) unsigned int generation;   //bumped by execute on every flush
+    unsigned int redirect;                  //where fetch starts again after a flush
+    unsigned long long codeLow;             //range of memory fetch has read instructions from
+    unsigned long long codeHigh;
+    bool done;                              //store has finished, every stage stops
+} ThreadedPipeline;
+
+//stageWait - polls a few times while another stage catches up, then gives up the core
+void stageWait(int *spins) {
+    if(++(*spins) > STAGE_SPINS) {
+        sched_yield();
+    }
+}
+
+//stagePush - adds item to queue, waiting while it is full. Returns 0 if the pipeline finishes first.
+bool stagePush(ThreadedPipeline *pipe, StageQueue *queue, StageItem *item) {
+    unsigned long long head = queue->head;
+    int spins = 0;
+    while(head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) >= STAGE_QUEUE_SIZE) {
+        if(__atomic_load_n(&pipe->done, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        stageWait(&spins);
+    }
+    queue->items[head & (STAGE_QUEUE_SIZE - 1)] = *item;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+//stagePop - takes the oldest item off queue, waiting while it is empty. Returns 0 if the pipeline finishes first.
+bool stagePop(ThreadedPipeline *pipe, StageQueue *queue, StageItem *item) {
+    unsigned long long tail = queue->tail;
+    int spins = 0;
+    while(__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == tail) {
+        if(__atomic_load_n(&pipe->done, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        stageWait(&spins);
+    }
+    *item = queue->items[tail & (STAGE_QUEUE_SIZE - 1)];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+//flushFetch - sends fetch to pc in a new generation, making everything already fetched stale
+void flushFetch(ThreadedPipeline *pipe, unsigned int pc, unsigned int *generation) {
+    __atomic_store_n(&pipe->redirect, pc, __ATOMIC_RELAXED);
+    __atomic_store_n(&pipe->generation, ++(*generation), __ATOMIC_RELEASE);
+}
+
+//wroteCode - whether the store or push execute just ran wrote over memory fetch has read instructions from
+bool wroteCode(ThreadedPipeline *pipe, SiaVM *vm, DecodedInstruction *instruction, unsigned int address) {
+    if(instruction->handler != HANDLER_STORE && instruction->handler != HANDLER_PUSH) {
+        return 0;
+    }
+    unsigned long long loc = ((instruction->handler == HANDLER_PUSH) ? (unsigned int)vm->registers[15] : address) & vm->memoryMask;
+    //pairs with the fence in fetchStage, either fetch reads the new bytes or this sees the range it read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long long low = __atomic_load_n(&pipe->codeLow, __ATOMIC_RELAXED);
+    unsigned long long high = __atomic_load_n(&pipe->codeHigh, __ATOMIC_RELAXED);
+    //a word wrapping around the top of memory is treated as code
+    return (loc < high && loc + 4 > low) || loc + 4 > (unsigned long long)vm->memoryMask + 1;
+}
+
+//fetchStage - fetch thread, predecodes instructions along its predicted path. It stops at a halt or an
+//illegal instruction until execute sends it somewhere else or the pipeline finishes.
+void *fetchStage(void *argument) {
+    ThreadedPipeline *pipe = argument;
+    SiaVM *vm = pipe->vm;
+    StageItem item;
+    memset(&item, 0, sizeof(item));
+    unsigned long long codeLow = ULLONG_MAX;
+    unsigned long long codeHigh = 0;
+    unsigned int generation = 0;
+    unsigned int pc = 0;
+    bool stopped = 1;
+    int spins = 0;
+    while(!__atomic_load_n(&pipe->done, __ATOMIC_ACQUIRE)) {
+        unsigned int current = __atomic_load_n(&pipe->generation, __ATOMIC_ACQUIRE);
+        if(current != generation) {
+            generation = current;
+            pc = __atomic_load_n(&pipe->redirect, __ATOMIC_RELAXED);
+            stopped = 0;
+        }
+        if(stopped) {
+            stageWait(&spins);
+            continue;
+        }
+        spins = 0;
+
+        //widen the range execute checks its writes against before reading the bytes
+        unsigned long long loc = pc & vm->memoryMask;
+        if(loc < codeLow || loc + 4 > codeHigh) {
+            codeLow = (loc < codeLow) ? loc : codeLow;
+            codeHigh = (loc + 4 > codeHigh) ? loc + 4 : codeHigh;
+            __atomic_store_n(&pipe->codeLow, codeLow, __ATOMIC_RELAXED);
+            __atomic_store_n(&pipe->codeHigh, codeHigh, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        }
+        predecodeInstruction(vm, loc, &item.instruction);
+        item.pc = pc;
+        item.generation = generation;
+        item.predicted = predictNext(&pipe->speculation, &item.instruction, pc);
+        if(!stagePush(pipe, &pipe->fetched, &item)) {
+            break;
+        }
+        pc = item.predicted;
+        stopped = item.instruction.handler == HANDLER_HALT || item.instruction.handler == HANDLER_ILLEGAL;
+    }
+    return NULL;
+}
+
+//decodeStage - decode thread, passes instructions on to execute, dropping any a flush has made stale
+void *decodeStage(void *argument) {
+    ThreadedPipeline *pipe = argument;
+    StageItem item;
+    while(stagePop(pipe, &pipe->fetched, &item)) {
+        if(item.generation != __atomic_load_n(&pipe->generation, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        if(!stagePush(pipe, &pipe->decoded, &item)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+//executeStage - execute thread, runs each instruction on the path the program really takes on execute's
+//copy of the VM. It prints what the VM prints, in program order, and flushes fetch when it went the wrong way.
+void *executeStage(void *argument) {
+    ThreadedPipeline *pipe = argument;
+    SiaVM *vm = &pipe->exec;
+    unsigned int generation = pipe->generation;
+    StageItem item;
+    while(stagePop(pipe, &pipe->decoded, &item)) {
+        if(item.generation != generation) {
+            continue;
+        }
+        if(item.pc != vm->PC) {
+            flushFetch(pipe, vm->PC, &generation);
+            continue;
+        }
+
+        //fetch's check for a stack collision, made here where the stack pointer is known
+        item.retire = 0;
+        item.stop = 0;
+        if(vm->PC + 4 >= vm->registers[15]) {
+            stackCollision(vm, vm->PC);
+            item.stop = 1;
+            stagePush(pipe, &pipe->executed, &item);
+            break;
+        }
+        item.instruction = *fetchDecoded(vm, vm->PC);
+        unsigned int address = vm->registers[item.instruction.reg2] + item.instruction.immediate;
+        runFast(vm, 1);
+        item.retire = 1;
+        item.next = vm->PC;
+        memcpy(item.registers, vm->registers, sizeof(item.registers));
+        if(pipe->vm->trace != NULL) {
+            fillTraceRecord(vm, &item.record, item.pc & vm->memoryMask, &item.instruction, address);
+        }
+
+        //the sequential pipeline still fetches after halt or an illegal instruction, and can run into the stack
+        if(vm->halt) {
+            unsigned int after = (item.instruction.handler == HANDLER_ILLEGAL) ? item.pc + item.instruction.length : vm->PC;
+            if(after + 4 >= vm->registers[15]) {
+                stackCollision(vm, after);
+            }
+            item.stop = 1;
+        }
+        bool flush = item.next != item.predicted || wroteCode(pipe, vm, &item.instruction, address);
+        if(!stagePush(pipe, &pipe->executed, &item) || item.stop) {
+            break;
+        }
+        if(flush) {
+            flushFetch(pipe, vm->PC, &generation);
+        }
+    }
+    return NULL;
+}
+
+//retireInstruction - store's work for one instruction. Commits the registers and PC execute left and
+//counts the cycle, forwarded operands, stalls and flushes the sequential pipeline would have.
+void retireInstruction(SiaVM *vm, StageItem *item) {
+    DecodedInstruction *instruction = &item->instruction;
+    unsigned char flags = isaFlags(instruction);
+    //the cache lookups happen in the same order and cycles as in the sequential pipeline, fetch's at the
+    //end of the cycle before
+    if(vm->icache != NULL) {
+        cacheAccess(vm, vm->icache, item->pc, item->pc, instruction->length);
+    }
+    vm->cycle++;
+    vm->fetchPC = predictNext(vm, instruction, item->pc);
+
+    //operands the execute step would have read off the scoreboard
+    if(flags & ISA_OPERANDS) {
+        scoreboardCheck(vm, instruction->reg1);
+        scoreboardCheck(vm, instruction->reg2);
+    }
+    else if(flags & ISA_ADDRESS) {
+        scoreboardCheck(vm, instruction->reg2);
+    }
+    else if(flags & ISA_STACK) {
+        scoreboardCheck(vm, 15);
+    }
+    else if(flags & ISA_DATA) {
+        scoreboardCheck(vm, instruction->reg1);
+    }
+    unsigned int address = vm->registers[instruction->reg2] + instruction->immediate;
+    if(vm->dcache != NULL && instruction->handler == HANDLER_LOAD) {
+        cacheAccess(vm, vm->dcache, item->pc, address, 4);
+    }
+    else if(vm->dcache != NULL && (instruction->handler == HANDLER_RETURN || instruction->handler == HANDLER_POP)) {
+        cacheAccess(vm, vm->dcache, item->pc, vm->registers[15], 4);
+    }
+    vm->retired++;
+    vm->mix[instruction->handler]++;
+    if(instruction->handler == HANDLER_ILLEGAL) {
+        return;
+    }
+
+    memcpy(vm->registers, item->registers, sizeof(vm->registers));
+    vm->PC = item->next;
+    if(vm->dcache != NULL && instruction->handler == HANDLER_STORE) {
+        cacheAccess(vm, vm->dcache, item->pc, address, 4);
+    }
+    else if(vm->dcache != NULL && instruction->handler == HANDLER_PUSH) {
+        cacheAccess(vm, vm->dcache, item->pc, vm->registers[15], 4);
+    }
+    switch(instruction->handler) {
+        case HANDLER_ADD: case HANDLER_AND: case HANDLER_DIVIDE: case HANDLER_MULTIPLY: case HANDLER_SUBTRACT: case HANDLER_OR:
+            scoreboardLog(vm, instruction->reg3, vm->registers[instruction->reg3], 0);
+            break;
+        case HANDLER_LOAD:
+            scoreboardLog(vm, instruction->reg1, vm->registers[instruction->reg1], 1);
+            break;
+        case HANDLER_MOVE:
+            scoreboardLog(vm, instruction->reg1, vm->registers[instruction->reg1], 0);
+            break;
+        case HANDLER_POP:
+            scoreboardLog(vm, instruction->reg1, vm->registers[instruction->reg1], 1);
+            scoreboardLog(vm, 15, vm->registers[15], 0);
+            break;
+        case HANDLER_RETURN: case HANDLER_PUSH:
+            scoreboardLog(vm, 15, vm->registers[15], 0);
+            break;
+    }
+    if(vm->trace != NULL) {
+        writeTraceRecord(vm, &item->record);
+    }
+    resolvePrediction(vm, instruction, item->pc);
+}
+
+//storeStage - store thread, retires instructions in program order until the last one
+void *storeStage(void *argument) {
+    ThreadedPipeline *pipe = argument;
+    StageItem item;
+    while(stagePop(pipe, &pipe->executed, &item)) {
+        if(item.retire) {
+            retireInstruction(pipe->vm, &item);
+        }
+        if(item.stop) {
+            break;
+        }
+    }
+    __atomic_store_n(&pipe->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+//runThreaded - runs vm to halt with each pipeline stage on its own thread
+void runThreaded(SiaVM *vm) {
+    ThreadedPipeline *pipe = calloc(1, sizeof(ThreadedPipeline));
+    if(pipe == NULL) {
+        vmPrint(vm, "unable to allocate pipeline threads\n");
+        vm->status = 1;
+        vm->halt = 1;
+        return;
+    }
+    //the first cycle only fetches, as in runPipeline
+    if(vm->cycle == 0) {
+        vm->fetchPC = vm->PC;
+        memset(vm->counters, 1, sizeof(vm->counters));
+    }
+    vm->cycle++;
+    pipe->vm = vm;
+    pipe->exec = *vm;
+    pipe->exec.trace = NULL;
+    pipe->speculation.predictor = PREDICT_STATIC;
+    pipe->generation = 1;
+    pipe->redirect = vm->PC;
+
+    //stages are pinned to cores in turn, sharing them when there are fewer than four
+    void *(*stages[4])(void *) = {fetchStage, decodeStage, executeStage, storeStage};
+    pthread_t threads[4];
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int started = 0;
+    for(; started < 4; started++) {
+        if(pthread_create(&threads[started], NULL, stages[started], pipe) != 0) {
+            break;
+        }
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(started % (cores > 0 ? cores : 1), &cpus);
+        pthread_setaffinity_np(threads[started], sizeof(cpus), &cpus);
+    }
+    if(started < 4) {
+        __atomic_store_n(&pipe->done, 1, __ATOMIC_RELEASE);
+    }
+    for(int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if(started < 4) {
+        vmPrint(vm, "unable to start pipeline threads\n");
+        pipe->exec.status = 1;
+    }
+
+    //execute's copy decided how the VM stopped, and may have grown the dirty page tables
+    vm->status = pipe->exec.status;
+    vm->halt = 1;
+    vm->dirtyPages = pipe->exec.dirtyPages;
+    vm->cleanCopies = pipe->exec.cleanCopies;
+    vm->dirtyCount = pipe->exec.dirtyCount;
+    vm->dirtyCapacity = pipe->exec.dirtyCapacity;
+    free(pipe);
+}
+
+
+
+///////////////////
+// VM Management //
+///////////////////
+// A SiaVM is created ready to load a program, run on one of the three engines and then destroyed.
+// Nothing is shared between VMs, so each one can run on its own thread.
+
+//execution engines
+enum {
+    ENGINE_PIPELINE, ENGINE_FAST, ENGINE_JIT, ENGINE_LANES, ENGINE_PROFILE, ENGINE_TRACE, ENGINE_THREADED, ENGINE_SAMPLE
+};
+
+//destroyVM - frees a VM from createVM
+void destroyVM(SiaVM *vm) {
+    if(vm == NULL) {
+        return;
+    }
+    if(vm->decodePages != NULL) {
+        for(unsigned int i = 0; i < codePageCount(vm); i++) {
+            if(!inImage(vm, vm->decodePages[i])) {
+                free(vm->decodePages[i]);
+            }
+        }
+        free(vm->decodePages);
+    }
+    if(vm->image != NULL) {
+        munmap(vm->image, vm->imageSize);
+    }
+    free(vm->dirtySlots);
+    free(vm->dirtyPages);
+    free(vm->cleanCopies);
+    free(vm->cleanState);
+    destroyCache(vm, vm->icache);
+    destroyCache(vm, vm->dcache);
+    if(vm->virtualMemory != NULL) {
+        munmap(vm->virtualMemory, (size_t)vm->memoryMask + 1);
+    }
+    free(vm);
+}
+
+//createVM - allocates a VM with memorySize bytes of empty memory, printing to stdout, returns NULL if out of
+//memory. memorySize is at most 4GB, the whole 32-bit address space.
+SiaVM *createVM(unsigned long long memorySize) {
+    SiaVM *vm = calloc(1, sizeof(SiaVM));
+    if(vm == NULL) {
+        return NULL;
+    }
+
+    //map memory rounded up to a power of two, reserving address space only. The OS commits pages as
+    //the program touches them, so a 4GB memory costs nothing until it is used.
+    unsigned long long mapped = 1024;
+    while(mapped < memorySize) {
+        mapped <<= 1;
+    }
+    vm->memorySize = memorySize;
+    vm->memoryMask = (unsigned int)(mapped - 1);
+    vm->virtualMemory = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    vm->decodePages = calloc(codePageCount(vm), sizeof(DecodedInstruction *));
+    vm->dirtySlots = calloc(dirtyPageCount(vm), sizeof(unsigned int));
+    if(vm->virtualMemory == MAP_FAILED || vm->decodePages == NULL || vm->dirtySlots == NULL) {
+        if(vm->virtualMemory == MAP_FAILED) {
+            vm->virtualMemory = NULL;
+        }
+        destroyVM(vm);
+        return NULL;
+    }
+
+    //the stack starts at the top of memory. A 4GB memory has no top address R15 can hold, so its stack
+    //starts one word below.
+    vm->stackTop = (memorySize > UINT_MAX) ? UINT_MAX - 3 : (unsigned int)memorySize;
+
+    //prepare for execution: set halt flag off, program counter to 0, and stack pointer to bottom of stack.
+    //The scoreboard starts empty.
+    vm->halt = 0;
+    vm->PC = 0;
+    vm->registers[15] = vm->stackTop;
+    vm->out = stdout;
+
+    //start with mutable buffers unmuted
+    vm->decodeBuff1Ready = 1;
+    vm->decodeBuff2Ready = 1;
+    vm->executeBuff1Ready = 1;
+    vm->executeBuff2Ready = 1;
+    vm->storeBuff1Ready = 1;
+    vm->storeBuff2Ready = 1;
+
+    //start with all instruction buffers invalid
+    //these are validated when a step outputs data for the next step, but invalidated
+    //whenever the program counter is moved with branch, call, jump, or return.
+    vm->decodeInstructionValid = 0;
+    vm->executeInstructionValid = 0;
+    vm->storeInstructionValid = 0;
+
+    return vm;
+}
+
+//runPipeline - runs the pipeline model until halt, or until budget more instructions have been stored
+void runPipeline(SiaVM *vm, unsigned long long budget) {
+    unsigned long long limit = (budget > ULLONG_MAX - vm->retired) ? ULLONG_MAX : vm->retired + budget;
+    //fetch starts where the program does, with the 2-bit counters weakly not taken. A pipeline restored
+    //from a snapshot carries on with its own.
+    if(vm->cycle == 0) {
+        vm->fetchPC = vm->PC;
+        memset(vm->counters, 1, sizeof(vm->counters));
+    }
+    while(!vm->halt && vm->retired < limit) {
+        //The main execution loop, continues to run until a halt instruction in executed.
+        //Fetch -> decode -> execute -> store -> repeat...halt
+        //These can now be executed in any order, and as long as all 4 execute before cycling
+        //the pipeline features should keep everything valid.
+        vm->cycle++;
+
+        executeInstruction(vm);
+        storeResult(vm);
+        fetchInstruction(vm);
+        decodeInstruction(vm);
+
+        //between cycles the buffers hold the next instruction, decoded and ready to execute
+        if(vm->snapshotPending) {
+            vm->snapshotPending = 0;
+            writeSnapshot(vm);
+        }
+    }
+}
+
+//runSampled - runs vm to halt under --sample, fast-forwarding on the fast engine between windows of the
+//pipeline model. The pipeline starts empty at the PC the fast engine stopped at, and the predictor and
+//caches carry on from the window before. The fast engine leaves them as they were, so a warm-up run of
+//the pipeline that isn't counted brings them up to date before the window.
+void runSampled(SiaVM *vm) {
+    while(!vm->halt) {
+        vm->markerReached = 0;
+        vm->fastForwarded += runFast(vm, vm->sampleMarker ? ULLONG_MAX : vm->sampleSkip);
+        if(vm->halt) {
+            break;
+        }
 
-            storeBuff1Ready = 1;//unmute
+        //nothing is in flight, the scoreboard's values are older than the registers the fast engine wrote
+        vm->fetchPC = vm->PC;
+        memset(vm->scoreboard, 0, sizeof(vm->scoreboard));
+        runPipeline(vm, vm->sampleWarmup);
+        unsigned long long cycles = vm->cycle;
+        unsigned long long retired = vm->retired;
+        runPipeline(vm, vm->sampleWindow);
+        //the instruction fetched for the next cycle is dropped, the fast engine fetches it again
+        vm->decodeInstructionValid = 0;
+        vm->executeInstructionValid = 0;
+        vm->storeInstructionValid = 0;
+        if(vm->retired == retired) {
+            continue;
         }
-        else if(storeBuff2Ready) {
-            storeBuff2Ready = 0;//mute
-            result2 = result;
-            for (int i = 0; i < 4; i++) {
-                storeInstructionBuffer2[i] = instruction[i];
+        vm->sampledCycles += vm->cycle - cycles;
+        vm->sampledInstructions += vm->retired - retired;
+        double cpi = (double)(vm->cycle - cycles) / (vm->retired - retired);
+        vm->minWindowCPI = (vm->windows == 0 || cpi < vm->minWindowCPI) ? cpi : vm->minWindowCPI;
+        vm->maxWindowCPI = (vm->windows == 0 || cpi > vm->maxWindowCPI) ? cpi : vm->maxWindowCPI;
+        vm->windows++;
+    }
+}
+
+//reportStats - prints the pipeline statistics and any cache models, as plain text or as one JSON object
+void reportStats(SiaVM *vm, FILE *out, bool json) {
+    char *predictors[] = {"none", "static", "2bit"};
+    double cpi = vm->retired ? (double)vm->cycle / vm->retired : 0.0;
+    double predicted = vm->branches ? 100.0 * (vm->branches - vm->flushes) / vm->branches : 100.0;
+    //under --sample the counts only cover what the pipeline ran, the whole program's cycles are estimated
+    //from the windows' CPI
+    unsigned long long total = vm->fastForwarded + vm->retired;
+    double sampledCPI = vm->sampledInstructions ? (double)vm->sampledCycles / vm->sampledInstructions : 0.0;
+    double estimated = sampledCPI * total;
+    if(json) {
+        fprintf(out, "{\"cycles\": %llu, \"instructions\": %llu, \"cpi\": %.3f, \"flushes\": %llu, "
+            "\"forwarded\": %llu, \"stalls\": %llu, \"predictor\": \"%s\", \"branches\": %llu, "
+            "\"predicted\": %.1f, \"flushesAvoided\": %llu, \"mix\": {",
+            vm->cycle, vm->retired, cpi, vm->flushes, vm->forwarded, vm->stalls, predictors[vm->predictor],
+            vm->branches, predicted, vm->flushesAvoided);
+        bool first = 1;
+        for(int i = 0; i < HANDLER_COUNT; i++) {
+            if(vm->mix[i] != 0) {
+                fprintf(out, "%s\"%s\": %llu", first ? "" : ", ", handlerNames[i], vm->mix[i]);
+                first = 0;
             }
-            storeBuff2Ready = 1;//unmute
         }
+        fprintf(out, "}");
+        if(vm->sampleWindow != 0) {
+            fprintf(out, ", \"sampling\": {\"windows\": %llu, \"detailed\": %llu, \"instructions\": %llu, "
+                "\"windowCPI\": %.3f, \"minCPI\": %.3f, \"maxCPI\": %.3f, \"estimatedCycles\": %.0f}",
+                vm->windows, vm->retired, total, sampledCPI, vm->minWindowCPI, vm->maxWindowCPI, estimated);
+        }
+        if(vm->icache != NULL) {
+            fprintf(out, ", ");
+            reportCache(vm, vm->icache, "icache", out, 1);
+        }
+        if(vm->dcache != NULL) {
+            fprintf(out, ", ");
+            reportCache(vm, vm->dcache, "dcache", out, 1);
+        }
+        fprintf(out, "}\n");
+        return;
+    }
+    fprintf(out, "Pipeline statistics: \n");
+    fprintf(out, "Cycles: %llu\nInstructions: %llu\nCPI: %.3f\n", vm->cycle, vm->retired, cpi);
+    fprintf(out, "Flushes: %llu\nForwarded operands: %llu\nLoad-use stalls: %llu\n", vm->flushes, vm->forwarded, vm->stalls);
+    fprintf(out, "Predictor %s: %llu branches, %.1f%% predicted, %llu flushes avoided\n",
+        predictors[vm->predictor], vm->branches, predicted, vm->flushesAvoided);
+    fprintf(out, "Instruction mix: \n");
+    for(int i = 0; i < HANDLER_COUNT; i++) {
+        if(vm->mix[i] != 0) {
+            fprintf(out, "%-24s %llu (%.1f%%)\n", handlerNames[i], vm->mix[i], 100.0 * vm->mix[i] / vm->retired);
+        }
+    }
+    if(vm->sampleWindow != 0) {
+        fprintf(out, "Sampled: %llu windows, %llu of %llu instructions in detail (%.2f%%)\n", vm->windows, vm->retired,
+            total, total ? 100.0 * vm->retired / total : 0.0);
+        fprintf(out, "Window CPI: %.3f, %.3f to %.3f\nEstimated cycles: %.0f\n", sampledCPI, vm->minWindowCPI,
+            vm->maxWindowCPI, estimated);
+    }
+    if(vm->icache != NULL) {
+        reportCache(vm, vm->icache, "Instruction cache", out, 0);
+    }
+    if(vm->dcache != NULL) {
+        reportCache(vm, vm->dcache, "Data cache", out, 0);
+    }
+}
+
+//Stack guard. With --stack the top of memory is set aside for the stack and the host page just below
+//it is made inaccessible. A push past the bottom of the stack, or code and data running up into it,
+//then faults in the host MMU instead of being checked on every instruction. The fault handler jumps
+//back into runVM, which reports the collision the same way fetch does.
+
+#include <setjmp.h>
 
-        storeInstructionValid = 1;
+long hostPageSize;                  //size of a host page, the size of the guard
+_Thread_local SiaVM *guardedVM;     //the VM running on this thread, while it has a guard page
+_Thread_local sigjmp_buf guardJump; //where runVM picks up after a fault in the guard page
+
+//stackGuardFault - SIGSEGV and SIGBUS handler. A fault in the running VM's guard page stops that VM,
+//anything else is a real crash and is handed back to the default action for the signal that arrived.
+void stackGuardFault(int number, siginfo_t *info, void *context) {
+    SiaVM *vm = guardedVM;
+    unsigned char *address = info->si_addr;
+    if(vm != NULL && address >= vm->stackGuard && address < vm->stackGuard + hostPageSize) {
+        siglongjmp(guardJump, 1);
     }
+    signal(number, SIG_DFL);
+    raise(number);
+}
 
+//installStackGuard - installs the fault handler, once, before any guarded VM runs
+void installStackGuard() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = stackGuardFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
 }
 
+//addStackGuard - sets aside the top stackSize bytes of memory for the stack and protects the page below
+//it. Returns 0 if that doesn't fit above the loadedLength bytes already loaded.
+bool addStackGuard(SiaVM *vm, unsigned long long stackSize, unsigned long long loadedLength) {
+    hostPageSize = sysconf(_SC_PAGESIZE);
+    if(stackSize == 0 || stackSize % hostPageSize != 0 || vm->memorySize < loadedLength + hostPageSize + stackSize) {
+        return 0;
+    }
+    unsigned char *guard = vm->virtualMemory + (vm->memorySize - stackSize - hostPageSize);
+    if(mprotect(guard, hostPageSize, PROT_NONE) != 0) {
+        return 0;
+    }
+    vm->stackGuard = guard;
+    return 1;
+}
 
-//store function - takes results from execute and stores them in memory or registers as instructed,
-//then updates program counter as needed.
-void storeResult() {
-    //printf("DEBUG: begin store...\n");
+//--stats output formats
+enum {STATS_OFF, STATS_TEXT, STATS_JSON};
 
-    if(storeInstructionValid) {
-        //prepare local variables with data from mutable double buffers outputted by execute function
-        unsigned char instruction[4];
-        unsigned char opcode, opcode2;
-        int result;
-        if(executeBuff1Ready) {
-            executeBuff1Ready = 0; //mute buffer
-            result = result1;
-            for (int i = 0; i < 4; i++) {
-                instruction[i] = executeInstructionBuffer1[i];
+//runVM - runs a loaded VM to completion on the given engine, returns its exit status
+int runVM(SiaVM *vm, int engine) {
+    //a fault in the guard page lands back here with whatever instruction was running still in PC
+    if(vm->stackGuard != NULL) {
+        guardedVM = vm;
+        if(sigsetjmp(guardJump, 1) != 0) {
+            guardedVM = NULL;
+            jitRelease(vm);
+            stackCollision(vm, vm->PC);
+            return vm->status;
+        }
+    }
+
+    if(engine == ENGINE_LANES) {
+        runLanes(&vm, 1);
+    }
+    else if(engine == ENGINE_JIT) {
+        runJit(vm);
+    }
+    else if(engine == ENGINE_FAST) {
+        runFast(vm, ULLONG_MAX);
+    }
+    else if(engine == ENGINE_PROFILE) {
+        runProfiled(vm);
+    }
+    else if(engine == ENGINE_TRACE) {
+        runTraced(vm);
+    }
+    else if(engine == ENGINE_THREADED) {
+        runThreaded(vm);
+    }
+    else if(engine == ENGINE_SAMPLE) {
+        runSampled(vm);
+    }
+    else {
+        runPipeline(vm, ULLONG_MAX);
+    }
+    guardedVM = NULL;
+    return vm->status;
+}
+
+
+
+//////////////
+// Snapshot //
+//////////////
+// Interrupt 2 writes the whole VM to the --snapshot file: registers, PC, pipeline buffers and valid
+// flags, scoreboard, predictor and counters, followed by memory. --restore maps a snapshot back in and
+// carries on from the instruction after the interrupt. Memory is mapped copy-on-write from the file
+// rather than read, so restoring takes the same few milliseconds however long the run to the snapshot.
+
+#define SNAPSHOT_MAGIC "SIAS"
+#define SNAPSHOT_HEADER_SIZE 65536  //memory starts here in the file, page aligned for any host page size
+
+//SnapshotHeader - the start of a snapshot file
+typedef struct SnapshotHeader {
+    char magic[4];
+    unsigned int vmSize;            //sizeof(SiaVM), a snapshot only restores into the build that wrote it
+    unsigned long long memorySize;
+    SiaVM state;                    //the VM, with every pointer cleared
+} SnapshotHeader;
+
+_Static_assert(sizeof(SnapshotHeader) <= SNAPSHOT_HEADER_SIZE, "SiaVM has outgrown the snapshot header");
+
+//writeSnapshot - writes vm to its snapshot file. Pages of memory that are all zero, as every page the
+//program never touched is, are left as holes in the file, and the guard page is never read.
+void writeSnapshot(SiaVM *vm) {
+    int file = open(vm->snapshotFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    SnapshotHeader *header = calloc(1, SNAPSHOT_HEADER_SIZE);
+    unsigned long long mapping = (unsigned long long)vm->memoryMask + 1;
+    if(file < 0 || header == NULL || ftruncate(file, SNAPSHOT_HEADER_SIZE + mapping) != 0) {
+        fprintf(stderr, "unable to write snapshot file\n");
+        if(file >= 0) {
+            close(file);
+        }
+        free(header);
+        return;
+    }
+
+    memcpy(header->magic, SNAPSHOT_MAGIC, 4);
+    header->vmSize = sizeof(SiaVM);
+    header->memorySize = vm->memorySize;
+    header->state = *vm;
+    header->state.virtualMemory = NULL;
+    header->state.stackGuard = NULL;
+    header->state.out = NULL;
+    header->state.output = NULL;
+    header->state.decodePages = NULL;
+    header->state.image = NULL;
+    header->state.imageSize = 0;
+    header->state.blocks = NULL;
+    header->state.blockCount = 0;
+    header->state.dirtySlots = NULL;
+    header->state.dirtyPages = NULL;
+    header->state.cleanCopies = NULL;
+    header->state.dirtyCount = 0;
+    header->state.dirtyCapacity = 0;
+    header->state.cleanState = NULL;
+    header->state.jit = NULL;
+    header->state.divergentCode = NULL;
+    header->state.profile = NULL;
+    header->state.trace = NULL;
+    header->state.icache = NULL;
+    header->state.dcache = NULL;
+    header->state.snapshotFile = NULL;
+    bool written = pwrite(file, header, SNAPSHOT_HEADER_SIZE, 0) == SNAPSHOT_HEADER_SIZE;
+
+    //copy memory a page at a time, leaving out the pages that are all zero
+    unsigned long long pageSize = sysconf(_SC_PAGESIZE);
+    unsigned long long pages = (mapping + pageSize - 1) / pageSize;
+    unsigned char *touched = touchedPages(vm, pageSize);
+    for(unsigned long long page = 0; written && page < pages; page++) {
+        unsigned char *bytes = vm->virtualMemory + page * pageSize;
+        if((touched != NULL && !(touched[page] & 1)) || bytes == vm->stackGuard) {
+            continue;
+        }
+        unsigned long long length = (mapping - page * pageSize < pageSize) ? mapping - page * pageSize : pageSize;
+        written = pwrite(file, bytes, length, SNAPSHOT_HEADER_SIZE + page * pageSize) == (ssize_t)length;
+    }
+    if(!written) {
+        fprintf(stderr, "unable to write snapshot file\n");
+    }
+    free(touched);
+    free(header);
+    close(file);
+}
+
+//mapSnapshot - maps the memory pages held in a snapshot file over the VM's memory, copy on write. Only
+//the file's data is mapped, its holes stay the VM's own zero pages so they still read as untouched
+bool mapSnapshot(SiaVM *vm, int file) {
+    unsigned long long pageSize = sysconf(_SC_PAGESIZE);
+    off_t end = SNAPSHOT_HEADER_SIZE + (off_t)vm->memoryMask + 1;
+    off_t data = lseek(file, SNAPSHOT_HEADER_SIZE, SEEK_DATA);
+    if(data < 0 && errno != ENXIO) {
+        //no hole support, map all of it
+        return mmap(vm->virtualMemory, (size_t)vm->memoryMask + 1, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, file, SNAPSHOT_HEADER_SIZE) != MAP_FAILED;
+    }
+    while(data >= 0 && data < end) {
+        off_t hole = lseek(file, data, SEEK_HOLE);
+        data = data / pageSize * pageSize;
+        hole = (hole < 0 || hole > end) ? end : (hole + pageSize - 1) / pageSize * pageSize;
+        if(mmap(vm->virtualMemory + (data - SNAPSHOT_HEADER_SIZE), hole - data, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, file, data) == MAP_FAILED) {
+            return 0;
+        }
+        data = lseek(file, hole, SEEK_DATA);
+    }
+    return 1;
+}
+
+//restoreSnapshot - creates a VM from a snapshot file, returns NULL if it can't be read
+SiaVM *restoreSnapshot(char *filename) {
+    int file = open(filename, O_RDONLY);
+    SnapshotHeader *header = malloc(sizeof(SnapshotHeader));
+    if(file < 0 || header == NULL || pread(file, header, sizeof(SnapshotHeader), 0) != sizeof(SnapshotHeader)
+            || memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0 || header->vmSize != sizeof(SiaVM)) {
+        fprintf(stderr, "unable to read snapshot file\n");
+        if(file >= 0) {
+            close(file);
+        }
+        free(header);
+        return NULL;
+    }
+
+    SiaVM *vm = createVM(header->memorySize);
+    if(vm == NULL || !mapSnapshot(vm, file)) {
+        fprintf(stderr, "unable to map snapshot file\n");
+        destroyVM(vm);
+        close(file);
+        free(header);
+        return NULL;
+    }
+
+    //take everything but the new VM's own memory and tables
+    SiaVM fresh = *vm;
+    *vm = header->state;
+    vm->virtualMemory = fresh.virtualMemory;
+    vm->out = fresh.out;
+    vm->decodePages = fresh.decodePages;
+    vm->dirtySlots = fresh.dirtySlots;
+    close(file);
+    free(header);
+    return vm;
+}
+
+
+
+//////////////////
+// Batch Runner //
+//////////////////
+// --batch runs every program in a directory, one VM per program, spread over a pool of worker threads.
+// Workers take the next program off a shared counter, so long programs don't hold up the others. Each
+// VM prints into its own temporary file, and once everything has finished the output is copied to
+// stdout in file name order so it reads the same as running the programs one after another.
+// --inputs does the same for one program and a directory of input images, each job starting from the
+// program loaded once up front with its input copied on top. Under --lanes a worker takes LANES inputs
+// at a time and runs them as one lane group.
+
+#include <dirent.h>
+#include <time.h>
+
+//one program in the batch
+typedef struct BatchJob {
+    char *path;
+    FILE *out;          //captured output
+    int status;
+    double seconds;     //wall time for load and run
+} BatchJob;
+
+//shared between the workers
+typedef struct Batch {
+    BatchJob *jobs;
+    int count;
+    int next;           //next job to hand out, taken with an atomic increment
+    int engine;
+    unsigned long long memorySize;
+    unsigned long long stackSize; //--stack: bytes set aside above a guard page, 0 for none
+    bool raw;           //--raw: load binaries as they are, even if they start with a header
+    int stats;          //--stats: add pipeline statistics to each job's output, STATS_TEXT or STATS_JSON
+    int predictor;      //--predict: branch predictor for the pipeline model
+    int verbosity;      //-v: how much each VM prints besides its interrupts
+    int outputFormat;   //--output: how each VM prints its dumps, OUTPUT_TEXT or OUTPUT_JSON
+    SiaVM *image;       //--inputs: memory image every job starts from, NULL for --batch
+    unsigned int imageLength; //--inputs: bytes of the image to copy, the rest of memory is zero
+    unsigned int inputAt; //--inputs: where input images are loaded
+} Batch;
+
+//elapsedSeconds - seconds since start
+double elapsedSeconds(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//prepareJob - creates and loads the VM for a job, returns NULL if it can't be run
+SiaVM *prepareJob(Batch *batch, BatchJob *job) {
+    job->status = 1;
+    job->out = tmpfile();
+    SiaVM *vm = createVM(batch->memorySize);
+    if(job->out == NULL || vm == NULL) {
+        destroyVM(vm);
+        return NULL;
+    }
+    vm->out = job->out;
+    vm->predictor = batch->predictor;
+    vm->verbosity = batch->verbosity;
+    vm->outputFormat = batch->outputFormat;
+
+    long long loaded;
+    if(batch->image != NULL) {
+        memcpy(vm->virtualMemory, batch->image->virtualMemory, batch->imageLength);
+        loaded = loadInput(vm, job->path, batch->inputAt);
+        loaded = (loaded >= 0 && loaded < batch->imageLength) ? batch->imageLength : loaded;
+        vm->PC = batch->image->PC;
+        vm->registers[15] = batch->image->registers[15];
+    }
+    else {
+        loaded = loadFile(vm, job->path, batch->raw);
+    }
+    if(loaded < 0) {
+        destroyVM(vm);
+        return NULL;
+    }
+    if(batch->stackSize != 0 && !addStackGuard(vm, batch->stackSize, loaded)) {
+        vmPrint(vm, "program too large for the stack guard\n");
+        destroyVM(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+//batchWorker - thread body, runs jobs until there are none left
+void *batchWorker(void *argument) {
+    Batch *batch = argument;
+    int width = (batch->image != NULL && batch->engine == ENGINE_LANES) ? LANES : 1;
+    int index;
+    while((index = __atomic_fetch_add(&batch->next, width, __ATOMIC_RELAXED)) < batch->count) {
+        int count = (batch->count - index < width) ? batch->count - index : width;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        SiaVM *vms[LANES];
+        int loaded = 0;
+        for(int i = 0; i < count; i++) {
+            SiaVM *vm = prepareJob(batch, &batch->jobs[index + i]);
+            if(vm != NULL) {
+                vms[loaded++] = vm;
+            }
+        }
+
+        if(width > 1) {
+            runLanes(vms, loaded);
+        }
+        else if(loaded == 1) {
+            runVM(vms[0], batch->engine);
+            if(batch->stats != STATS_OFF) {
+                reportStats(vms[0], vms[0]->out, batch->stats == STATS_JSON);
+            }
+        }
+
+        //jobs that didn't load keep status 1
+        for(int i = 0, v = 0; i < count; i++) {
+            BatchJob *job = &batch->jobs[index + i];
+            if(v < loaded && vms[v]->out == job->out) {
+                job->status = vms[v]->status;
+                destroyVM(vms[v++]);
             }
-            executeBuff1Ready = 1; //unmute buffer
+            job->seconds = elapsedSeconds(&start);
+        }
+    }
+    return NULL;
+}
+
+//compareJobs - qsort order for jobs, by path
+int compareJobs(const void *a, const void *b) {
+    return strcmp(((const BatchJob *)a)->path, ((const BatchJob *)b)->path);
+}
+
+//runBatch - runs every file in directory on threads workers, as programs or, given an image holding a
+//program of imageLength bytes, as inputs loaded at inputAt. The caller fills in the engine and VM
+//settings of batch, the jobs are collected here. Returns 1 if any job failed.
+int runBatch(char *directory, int threads, Batch settings) {
+    DIR *dir = opendir(directory);
+    if(dir == NULL) {
+        fprintf(stderr, "unable to open batch directory\n");
+        return 1;
+    }
+
+    //collect the jobs
+    Batch batch = settings;
+    int capacity = 0;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] == '.') {
+            continue;
+        }
+        if(batch.count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            batch.jobs = realloc(batch.jobs, capacity * sizeof(BatchJob));
+        }
+        BatchJob *job = &batch.jobs[batch.count++];
+        memset(job, 0, sizeof(BatchJob));
+        job->path = malloc(strlen(directory) + strlen(entry->d_name) + 2);
+        sprintf(job->path, "%s/%s", directory, entry->d_name);
+    }
+    closedir(dir);
+    qsort(batch.jobs, batch.count, sizeof(BatchJob), compareJobs);
+
+    //no more threads than programs, and at least one even for an empty list
+    if(threads > batch.count) {
+        threads = batch.count;
+    }
+    if(threads < 1) {
+        threads = 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for(; workers != NULL && started < threads; started++) {
+        if(pthread_create(&workers[started], NULL, batchWorker, &batch) != 0) {
+            break;
         }
-        else if(executeBuff2Ready) { 
-            executeBuff2Ready = 0; //mute buffer
-            result = result2;
-            for (int i = 0; i < 4; i++) {
-                instruction[i] = executeInstructionBuffer2[i];
+    }
+    //if no thread could be started do the work here
+    if(started == 0) {
+        batchWorker(&batch);
+    }
+    for(int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    double seconds = elapsedSeconds(&start);
+    free(workers);
+
+    //report in order
+    int failed = 0;
+    char buffer[4096];
+    for(int i = 0; i < batch.count; i++) {
+        BatchJob *job = &batch.jobs[i];
+        printf("=== %s (status %d, %.3f ms) ===\n", job->path, job->status, job->seconds * 1000);
+        if(job->out != NULL) {
+            rewind(job->out);
+            size_t length;
+            while((length = fread(buffer, 1, sizeof(buffer), job->out)) > 0) {
+                fwrite(buffer, 1, length, stdout);
             }
-            executeBuff2Ready = 1; //unmute buffer
+            fclose(job->out);
         }
+        failed |= job->status != 0;
+        free(job->path);
+    }
+    //the work was done here when no thread could be started
+    int used = started ? started : 1;
+    char *noun = (batch.image != NULL) ? "input" : "program";
+    printf("Ran %d %s%s on %d thread%s in %.3f s (%.1f %ss/s)\n", batch.count, noun, (batch.count == 1) ? "" : "s",
+        used, (used == 1) ? "" : "s", seconds, seconds > 0 ? batch.count / seconds : 0.0, noun);
+    free(batch.jobs);
+    return failed;
+}
+
+
+
+/////////////////
+// Fork Server //
+/////////////////
+// --fork-server and --fork-socket run one program over a stream of inputs without loading it again for
+// each one. The program is loaded once, and under --checkpoint run until it reaches interrupt 3. Then
+// the server forks a child per input: the child has a copy-on-write copy of the VM, copies its input in
+// at --input-at and carries on running, so pages neither side writes stay shared and starting a job
+// costs about as much as a fork. --fork-server reads input paths from a list file, one per line, and
+// reports each input's output the way --inputs does. --fork-socket takes inputs from clients of a Unix
+// socket instead, each connection sending one input and reading the output back.
 
-        //all instrucitons begin with a 4-bit opcode, branch and stack have 2 opcodes
-        opcode = highHalfByte(instruction[0]);
-        if(opcode == 7){opcode2 = lowHalfByte(instruction[0]);}
-        else if(opcode == 10) {opcode2 = instruction[1] >> 6;}
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+//one input of a --fork-server list
+typedef struct ForkJob {
+    char *path;
+    FILE *out;              //captured output, written by the child
+    pid_t pid;              //child running the job, 0 once it has finished
+    int status;
+    struct timespec start;
+    double seconds;         //wall time from fork to exit
+} ForkJob;
+
+//runForkJob - runs the input a fork server child was handed, the image loaded up to end. Returns the
+//exit status for the child.
+int runForkJob(SiaVM *vm, Batch *settings, long long end) {
+    int status = 1;
+    if(end >= 0) {
+        //the input may land on instructions decoded before the checkpoint
+        for(long long loc = settings->inputAt; loc < end; loc += 4) {
+            invalidateDecoded(vm, (unsigned int)loc);
+        }
+        vm->halt = 0;
+        status = runVM(vm, settings->engine);
+        if(settings->stats != STATS_OFF) {
+            reportStats(vm, vm->out, settings->stats == STATS_JSON);
+        }
+    }
+    fflush(vm->out);
+    return status;
+}
 
+//serveList - forks a child for every input listed in the file at path, at most threads at a time.
+//Output is reported in list order. Returns 1 if any input failed.
+int serveList(SiaVM *vm, char *path, int threads, Batch *settings) {
+    FILE *list = fopen(path, "r");
+    if(list == NULL) {
+        fprintf(stderr, "unable to open input list\n");
+        return 1;
+    }
 
-        //3R instructions OPCODE 1-6
-        if(opcode >= 1 && opcode <= 6) {
-            int reg = get3R3(instruction);
-            registers[reg] = result;
-            historyLog(reg, result);
-            PC += 2;
+    //collect the jobs, one per non-empty line
+    ForkJob *jobs = NULL;
+    int count = 0;
+    int capacity = 0;
+    char *line = NULL;
+    size_t lineSize = 0;
+    while(getline(&line, &lineSize, list) >= 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] == '\0') {
+            continue;
+        }
+        if(count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            jobs = realloc(jobs, capacity * sizeof(ForkJob));
         }
-        //Branch Instructions OPCODE 7 - 4-byte instructions
-        else if(opcode == 7) {
-            //call branch type 6
-            if(opcode2 == 6) {
-                PC = result;
-                invalidatePipeline();//when branch is taken, sequential instructions in pipeline become invalid
+        memset(&jobs[count], 0, sizeof(ForkJob));
+        jobs[count++].path = strdup(line);
+    }
+    free(line);
+    fclose(list);
+    if(threads < 1) {
+        threads = 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int next = 0;
+    int running = 0;
+    int processes = 0;  //most jobs running at once
+    int failed = 0;
+    char buffer[4096];
+    for(int reported = 0; reported < count; ) {
+        //start jobs until threads are running
+        while(next < count && running < threads) {
+            ForkJob *job = &jobs[next++];
+            job->status = 1;
+            job->out = tmpfile();
+            clock_gettime(CLOCK_MONOTONIC, &job->start);
+            fflush(stdout);
+            job->pid = (job->out != NULL) ? fork() : -1;
+            if(job->pid == 0) {
+                vm->out = job->out;
+                _exit(runForkJob(vm, settings, loadInput(vm, job->path, settings->inputAt)));
             }
-            //jump branch type 7
-            else if(opcode2 == 7) {
-                invalidatePipeline();
-                PC = result;
+            if(job->pid < 0) {
+                job->pid = 0;
             }
-            //else conditional branches, branch types 0-5
             else {
-                //condition for branching not met
-                if(result == -1) {
-                    PC += 4;
+                running++;
+                if(running > processes) {
+                    processes = running;
                 }
-                //condition for branching met
-                else {
-                    invalidatePipeline();
-                    PC += result;
+            }
+        }
+
+        //wait for one to finish
+        if(running > 0) {
+            int result;
+            pid_t pid = waitpid(-1, &result, 0);
+            for(int i = reported; i < next; i++) {
+                if(pid > 0 && jobs[i].pid == pid) {
+                    jobs[i].pid = 0;
+                    jobs[i].status = WIFEXITED(result) ? WEXITSTATUS(result) : 1;
+                    jobs[i].seconds = elapsedSeconds(&jobs[i].start);
+                    running--;
                 }
             }
         }
 
-        //load OPCODE 8
-        else if(opcode == 8) {
-            //store result in specified register
-            int reg = lowHalfByte(instruction[0]);
-            registers[reg] = result;
-            historyLog(reg, result); //log register change for later forwarding
-            PC += 2;
-        }
-        //store OPCODE 9
-        else if(opcode == 9) {
-            //store data from specified 32-bit register into 4 bytes of virtual memory,
-            //by splitting and shifting each octet.
-            virtualMemory[result] = registers[lowHalfByte(instruction[0])] >> 24;
-            virtualMemory[result + 1] = registers[lowHalfByte(instruction[0])] >> 16;
-            virtualMemory[result + 2] = registers[lowHalfByte(instruction[0])] >> 8;
-            virtualMemory[result + 3] = registers[lowHalfByte(instruction[0])];
-            PC += 2;
-        }
-
-        //stack instructions OPCODE 10
-        else if(opcode == 10) {
-            switch(opcode2) {
-                int reg;
-                //return
-                case 0:
-                    //update the stack pointer, down 4 bytes as data was popped off in execute step
-                    moveStackPointer(4);
-                    //update program counter to new instruciton location for next fetch
-                    PC = result;
-                    break;
+        //report every finished job at the front of the list
+        for(; reported < next && jobs[reported].pid == 0; reported++) {
+            ForkJob *job = &jobs[reported];
+            printf("=== %s (status %d, %.3f ms) ===\n", job->path, job->status, job->seconds * 1000);
+            if(job->out != NULL) {
+                rewind(job->out);
+                size_t length;
+                while((length = fread(buffer, 1, sizeof(buffer), job->out)) > 0) {
+                    fwrite(buffer, 1, length, stdout);
+                }
+                fclose(job->out);
+            }
+            failed |= job->status != 0;
+            free(job->path);
+        }
+    }
+    double seconds = elapsedSeconds(&start);
+    printf("Ran %d input%s on %d process%s in %.3f s (%.1f inputs/s)\n", count, (count == 1) ? "" : "s",
+        processes, (processes == 1) ? "" : "es", seconds, seconds > 0 ? count / seconds : 0.0);
+    free(jobs);
+    return failed;
+}
 
-                //push
-                case 1:
-                    //update stack pointer, up 4 butes as we push data onto stack
-                    moveStackPointer(-4);
-                    //store data from execute result in virtual memory at stack pointer by shifting and storing each octet
-                    virtualMemory[registers[15]] = result >> 24;
-                    virtualMemory[registers[15] + 1] = result >> 16;
-                    virtualMemory[registers[15] + 2] = result >> 8;
-                    virtualMemory[registers[15] + 3] = result;
-                    PC += 2;
-                    break;
+//serveSocket - listens on a Unix socket at path and forks a child for every connection, at most threads
+//at a time. The child reads the input from the connection until the client shuts down its side, then
+//writes the output back and closes it. Only returns if the socket can't be set up.
+int serveSocket(SiaVM *vm, char *path, int threads, Batch *settings) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server < 0 || strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "unable to open fork server socket\n");
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if(bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server, 64) != 0) {
+        fprintf(stderr, "unable to open fork server socket\n");
+        close(server);
+        return 1;
+    }
+    printf("Fork server listening on %s\n", path);
+    fflush(stdout);
 
-                //pop
-                case 2:
-                    //store execute result in specified register
-                    reg = getStackRegister(instruction);
-                    registers[reg] = result;
-                    historyLog(reg, result);
-                    //move stack pointer down 4 bytes as we popped off data
-                    moveStackPointer(4);
-                    PC += 2;
-                    break;
+    int running = 0;
+    while(1) {
+        int connection = accept(server, NULL, NULL);
+        if(connection < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
+            break;
         }
-
-        //move
-        else if(opcode == 11) {
-            //store result from execute in specified register
-            int reg = getMoveRegister(instruction);
-            registers[reg] = result;
-            historyLog(reg, result);
-            PC += 2;
+        //reap finished children, waiting for one if threads are running
+        while(running > 0 && waitpid(-1, NULL, (running < threads) ? WNOHANG : 0) > 0) {
+            running--;
         }
 
-        //interrupt
-        else if(opcode == 12) {
-            //only need to advance program counter here.
-            PC += 2;
+        pid_t pid = fork();
+        if(pid == 0) {
+            close(server);
+            FILE *in = fdopen(connection, "rb");
+            vm->out = fdopen(dup(connection), "wb");
+            if(in == NULL || vm->out == NULL) {
+                _exit(1);
+            }
+            long long end = readInput(vm, in, settings->inputAt);
+            fclose(in);
+            _exit(runForkJob(vm, settings, end));
+        }
+        if(pid > 0) {
+            running++;
         }
+        close(connection);
+    }
+    close(server);
+    unlink(path);
+    return 1;
+}
 
-        //halt
-        else if(opcode == 0) {
-            //not actually necessary to advance PC, halts execution before next fetch
-            PC += 2;
+//runForkServer - runs vm to its checkpoint if it has one, then forks a child per input from source, a
+//list file or, with fromSocket set, a Unix socket path. Takes the engine, --stats and --input-at from
+//settings. Returns 1 if the program doesn't reach its checkpoint or any input failed.
+int runForkServer(SiaVM *vm, char *source, bool fromSocket, bool checkpoint, int threads, Batch settings) {
+    if(checkpoint) {
+        vm->checkpoint = 1;
+        runVM(vm, settings.engine);
+        if(vm->checkpoint) {
+            fprintf(stderr, "program halted before reaching its checkpoint\n");
+            return 1;
         }
     }
+    if(fromSocket) {
+        return serveSocket(vm, source, threads, &settings);
+    }
+    return serveList(vm, source, threads, &settings);
 }
 
+
+
 //////////////////////////
 // Main - Program Entry //
 //////////////////////////
 
-int main (int argc, char **argv)  {
-    //prepare for execution: set halt flag off, program counter to 0, resultHistoryCursor to 0, and stack pointer to bottom of stack
-    halt = 0;
-    PC = 0;
-    resultHistoryCursor = 0;
-    registers[15] = 1000;
+//parseSize - reads a number of bytes with an optional K, M or G suffix, returns 0 if it isn't one
+unsigned long long parseSize(char *text) {
+    char *end;
+    unsigned long long size = strtoull(text, &end, 0);
+    if(*end == 'K' || *end == 'k') {
+        size <<= 10;
+        end++;
+    }
+    else if(*end == 'M' || *end == 'm') {
+        size <<= 20;
+        end++;
+    }
+    else if(*end == 'G' || *end == 'g') {
+        size <<= 30;
+        end++;
+    }
+    return (*end == '\0') ? size : 0;
+}
 
-    //start with mutable buffers unmuted
-    decodeBuff1Ready = 1;
-    decodeBuff2Ready = 1;
-    executeBuff1Ready = 1;
-    executeBuff2Ready = 1;
-    storeBuff1Ready = 1;
-    storeBuff2Ready = 1;
+//parseMemorySize - reads a --mem size. Returns 0 unless it is a power of two from 1K to 4G.
+unsigned long long parseMemorySize(char *text) {
+    unsigned long long size = parseSize(text);
+    if(size < 1024 || size > (1ULL << 32) || (size & (size - 1)) != 0) {
+        return 0;
+    }
+    return size;
+}
 
-    //start with all instruction buffers invalid
-    //these are validated when a step outputs data for the next step, but invalidated
-    //whenever the program counter is moved with branch, call, jump, or return.
-    decodeInstructionValid = 0;
-    executeInstructionValid = 0;
-    storeInstructionValid = 0;
-    
+//parseCache - reads a cache shape, "size,ways,line" with an optional ",lru" or ",random", into shape.
+//Returns 0 unless the line is a power of two of at least 4 bytes and the sets come out a power of two.
+bool parseCache(char *text, Cache *shape) {
+    char size[32];
+    char replacement[16] = "lru";
+    if(sscanf(text, "%31[^,],%u,%u,%15s", size, &shape->ways, &shape->lineSize, replacement) < 3) {
+        return 0;
+    }
+    unsigned long long bytes = parseSize(size);
+    shape->replacement = (strcmp(replacement, "random") == 0) ? REPLACE_RANDOM : REPLACE_LRU;
+    if(shape->replacement == REPLACE_LRU && strcmp(replacement, "lru") != 0) {
+        return 0;
+    }
+    if(shape->ways == 0 || shape->lineSize < 4 || (shape->lineSize & (shape->lineSize - 1)) != 0
+            || bytes > (1ULL << 30) || bytes % ((unsigned long long)shape->ways * shape->lineSize) != 0) {
+        return 0;
+    }
+    shape->size = (unsigned int)bytes;
+    shape->sets = shape->size / (shape->ways * shape->lineSize);
+    return shape->sets != 0 && (shape->sets & (shape->sets - 1)) == 0;
+}
+
+//parseSample - reads a --sample setting, "skip,window" or "marker,window" with an optional ",warmup",
+//returns 0 unless window is at least 1
+bool parseSample(char *text, unsigned long long *skip, unsigned long long *window, unsigned long long *warmup, bool *marker) {
+    char *end;
+    *marker = strncmp(text, "marker,", 7) == 0;
+    *skip = *marker ? 0 : strtoull(text, &end, 0);
+    if(!*marker && *end != ',') {
+        return 0;
+    }
+    *window = strtoull(*marker ? text + 7 : end + 1, &end, 0);
+    *warmup = (*end == ',') ? strtoull(end + 1, &end, 0) : 0;
+    return *end == '\0' && *window != 0;
+}
+
+int main (int argc, char **argv)  {
+    //parse options, anything not starting with "--" is the binary to execute.
+    //--fast runs the functional engine instead of the pipeline model, --jit compiles it to native code,
+    //--lanes runs inputs in lockstep lane groups.
+    //--batch runs every binary in a directory on --threads worker threads, one per core by default.
+    //--inputs runs the binary once per input image in a directory, loaded at --input-at or right after the program.
+    //--mem sets the size of memory, 1000 bytes by default.
+    //--stack sets aside the top of memory for the stack, below a guard page.
+    //--raw loads binaries without looking for a header.
+    //--stats prints the pipeline model's statistics at halt, --stats=json as JSON.
+    //--predict picks the pipeline model's branch predictor.
+    //--profile counts every PC, block and call into a flamegraph file, --profile-hz samples the PC instead.
+    //--trace writes a binary record of every instruction run, for SIATrace.
+    //--snapshot names the file interrupt 2 writes the VM to, --restore carries on from one instead of loading a binary.
+    //--fork-server forks a copy of the loaded VM per input in a list file, --fork-socket per input sent to a Unix
+    //socket, after running to interrupt 3 under --checkpoint.
+    //--repeat runs the program N times in one VM, resetting the memory it wrote in between.
+    //-v prints the stack pointer whenever it moves, --output=json prints the register and memory dumps as JSON.
+    //--threaded runs each pipeline stage on its own thread.
+    //--icache and --dcache model L1 caches in the pipeline, missing costs --miss-penalty cycles.
+    //--sample alternates the fast engine with windows of the pipeline and estimates the whole program's cycles.
+    char *filename = NULL;
+    char *batchDirectory = NULL;
+    char *inputDirectory = NULL;
+    long long inputAt = -1;
+    unsigned long long memorySize = DEFAULT_MEMORY_SIZE;
+    unsigned long long stackSize = 0;
+    bool raw = 0;
+    int stats = STATS_OFF;
+    int predictor = PREDICT_NONE;
+    char *profileFile = NULL;
+    char *traceFile = NULL;
+    char *snapshotFile = NULL;
+    char *restoreFile = NULL;
+    char *forkSource = NULL;
+    bool forkSocket = 0;
+    bool checkpoint = 0;
+    bool threaded = 0;
+    Cache icache = {0};
+    Cache dcache = {0};
+    int missPenalty = DEFAULT_MISS_PENALTY;
+    unsigned long long sampleSkip = 0;
+    unsigned long long sampleWindow = 0;
+    unsigned long long sampleWarmup = 0;
+    bool sampleMarker = 0;
+    int repeat = 1;
+    int verbosity = 0;
+    int outputFormat = OUTPUT_TEXT;
+    int profileHz = 0;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int engine = ENGINE_PIPELINE;
+    bool badArgs = 0;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--fast") == 0) {
+            engine = ENGINE_FAST;
+        }
+        else if(strcmp(argv[i], "--jit") == 0) {
+            engine = ENGINE_JIT;
+        }
+        else if(strcmp(argv[i], "--lanes") == 0) {
+            engine = ENGINE_LANES;
+        }
+        else if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batchDirectory = argv[++i];
+        }
+        else if(strcmp(argv[i], "--inputs") == 0 && i + 1 < argc) {
+            inputDirectory = argv[++i];
+        }
+        else if(strcmp(argv[i], "--input-at") == 0 && i + 1 < argc) {
+            inputAt = strtoll(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "--mem") == 0 && i + 1 < argc) {
+            memorySize = parseMemorySize(argv[++i]);
+            badArgs |= memorySize == 0;
+        }
+        else if(strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+            stats = STATS_TEXT;
+        }
+        else if(strcmp(argv[i], "--stats=json") == 0) {
+            stats = STATS_JSON;
+        }
+        else if(strcmp(argv[i], "--predict") == 0 && i + 1 < argc) {
+            i++;
+            predictor = (strcmp(argv[i], "static") == 0) ? PREDICT_STATIC : (strcmp(argv[i], "2bit") == 0) ? PREDICT_2BIT : PREDICT_NONE;
+            badArgs |= predictor == PREDICT_NONE && strcmp(argv[i], "none") != 0;
+        }
+        else if(strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profileFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--profile-hz") == 0 && i + 1 < argc) {
+            profileHz = atoi(argv[++i]);
+            badArgs |= profileHz <= 0;
+        }
+        else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            traceFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshotFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restoreFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--fork-server") == 0 && i + 1 < argc) {
+            forkSource = argv[++i];
+            forkSocket = 0;
+        }
+        else if(strcmp(argv[i], "--fork-socket") == 0 && i + 1 < argc) {
+            forkSource = argv[++i];
+            forkSocket = 1;
+        }
+        else if(strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+            badArgs |= repeat < 1;
+        }
+        else if(strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            verbosity++;
+        }
+        else if(strcmp(argv[i], "--output=text") == 0) {
+            outputFormat = OUTPUT_TEXT;
+        }
+        else if(strcmp(argv[i], "--output=json") == 0) {
+            outputFormat = OUTPUT_JSON;
+        }
+        else if(strcmp(argv[i], "--checkpoint") == 0) {
+            checkpoint = 1;
+        }
+        else if(strcmp(argv[i], "--threaded") == 0) {
+            threaded = 1;
+        }
+        else if(strcmp(argv[i], "--icache") == 0 && i + 1 < argc) {
+            badArgs |= !parseCache(argv[++i], &icache);
+        }
+        else if(strcmp(argv[i], "--dcache") == 0 && i + 1 < argc) {
+            badArgs |= !parseCache(argv[++i], &dcache);
+        }
+        else if(strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            badArgs |= !parseSample(argv[++i], &sampleSkip, &sampleWindow, &sampleWarmup, &sampleMarker);
+        }
+        else if(strcmp(argv[i], "--miss-penalty") == 0 && i + 1 < argc) {
+            missPenalty = atoi(argv[++i]);
+            badArgs |= missPenalty < 0;
+        }
+        else if(strcmp(argv[i], "--raw") == 0) {
+            raw = 1;
+        }
+        else if(strcmp(argv[i], "--stack") == 0 && i + 1 < argc) {
+            stackSize = parseSize(argv[++i]);
+            badArgs |= stackSize == 0 || stackSize % sysconf(_SC_PAGESIZE) != 0;
+        }
+        else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        }
+        else if(strncmp(argv[i], "--", 2) != 0 && filename == NULL) {
+            filename = argv[i];
+        }
+        else {
+            badArgs = 1;
+        }
+    }
 
     //make sure proper # of arguments given, otherwise output hint.
-    if (argc != 2) {
-        printf ("Bad Args. Hint: siavm.exe file.bin\n"); 
+    badArgs |= stackSize != 0 && engine == ENGINE_LANES;
+    badArgs |= (stats != STATS_OFF || predictor != PREDICT_NONE) && engine != ENGINE_PIPELINE;
+    bool caches = icache.size != 0 || dcache.size != 0;
+    badArgs |= caches && (engine != ENGINE_PIPELINE || batchDirectory != NULL || inputDirectory != NULL || forkSource != NULL);
+    badArgs |= sampleWindow != 0 && (engine != ENGINE_PIPELINE || threaded || batchDirectory != NULL || inputDirectory != NULL
+        || forkSource != NULL || traceFile != NULL || profileFile != NULL);
+    badArgs |= profileFile == NULL ? profileHz != 0
+        : batchDirectory != NULL || inputDirectory != NULL || (profileHz == 0 && (stats != STATS_OFF || predictor != PREDICT_NONE));
+    badArgs |= traceFile != NULL && (batchDirectory != NULL || inputDirectory != NULL || profileFile != NULL);
+    badArgs |= restoreFile != NULL && (filename != NULL || inputDirectory != NULL || stackSize != 0);
+    badArgs |= forkSource == NULL ? checkpoint
+        : batchDirectory != NULL || inputDirectory != NULL || profileFile != NULL || traceFile != NULL
+            || engine == ENGINE_LANES || (restoreFile != NULL && inputAt < 0);
+    badArgs |= repeat > 1 && (batchDirectory != NULL || inputDirectory != NULL || forkSource != NULL);
+    badArgs |= threaded && (engine != ENGINE_PIPELINE || stackSize != 0 || batchDirectory != NULL || inputDirectory != NULL
+        || profileFile != NULL || snapshotFile != NULL || restoreFile != NULL || forkSource != NULL);
+    bool program = filename != NULL || restoreFile != NULL;
+    if (badArgs || program == (batchDirectory != NULL) || (inputDirectory != NULL && filename == NULL)) {
+        printf ("Bad Args. Hint: siavm.exe [--fast | --jit | --lanes] [--mem size] [--stack size] [--raw] file.bin\n"
+                "               siavm.exe [--fast | --jit] [--mem size] [--stack size] [--raw] --batch directory [--threads N]\n"
+                "               siavm.exe [--fast | --jit | --lanes] [--mem size] [--stack size] [--raw] --inputs directory [--input-at address] [--threads N] file.bin\n"
+                "               --mem takes a power of two from 1K to 4G, --stack a multiple of the page size\n"
+                "               --stack can't be used with --lanes, --stats and --predict only with the pipeline\n"
+                "               siavm.exe [--predict none | static | 2bit] [--stats[=json]] file.bin\n"
+                "               siavm.exe [--fast | --jit] --profile stacks.txt [--profile-hz N] file.bin\n"
+                "               siavm.exe [--fast] --trace trace.bin file.bin\n"
+                "               siavm.exe [--fast | --jit] [--snapshot snapshot.bin] (file.bin | --restore snapshot.bin)\n"
+                "               siavm.exe [--fast | --jit] (--fork-server list.txt | --fork-socket path) [--checkpoint] [--input-at address] [--threads N] file.bin\n"
+                "               siavm.exe [--fast | --jit] --repeat N file.bin\n"
+                "               siavm.exe --threaded [--predict none | static | 2bit] [--stats[=json]] [--trace trace.bin] file.bin\n"
+                "               siavm.exe [--icache size,ways,line[,lru | random]] [--dcache size,ways,line[,lru | random]] [--miss-penalty N] file.bin\n"
+                "               siavm.exe --sample (skip | marker),window[,warmup] [--predict none | static | 2bit] [--stats[=json]] file.bin\n"
+                "               -v prints the stack pointer as it moves, --output=json prints dumps as JSON\n"); 
         exit(1);
     }
-        
-    //load file with instructions to execute
-    loadFile(argv[1]);
+    if(stackSize != 0) {
+        installStackGuard();
+    }
 
-    while(!halt) {
-        //The main execution loop, continues to run until a halt instruction in executed.
-        //Fetch -> decode -> execute -> store -> repeat...halt
-        //These can now be executed in any order, and as long as all 4 execute before cycling
-        //the pipeline features should keep everything valid.
+    Batch settings = {0};
+    settings.engine = engine;
+    settings.memorySize = memorySize;
+    settings.stackSize = stackSize;
+    settings.raw = raw;
+    settings.stats = stats;
+    settings.predictor = predictor;
+    settings.verbosity = verbosity;
+    settings.outputFormat = outputFormat;
+    if(batchDirectory != NULL) {
+        return runBatch(batchDirectory, threads, settings);
+    }
 
-        executeInstruction();
-        storeResult();
-        fetchInstruction();
-        decodeInstruction();
+    //restore a snapshot, or load file with instructions to execute
+    SiaVM *vm;
+    long long end = 0;
+    if(restoreFile != NULL) {
+        vm = restoreSnapshot(restoreFile);
+        if(vm == NULL) {
+            exit(1);
+        }
+    }
+    else {
+        vm = createVM(memorySize);
+        if(vm == NULL) {
+            fprintf(stderr, "unable to allocate VM\n");
+            exit(1);
+        }
+        end = loadFile(vm, filename, raw);
+        if(end < 0) {
+            exit(1);
+        }
+    }
+    if(restoreFile == NULL || predictor != PREDICT_NONE) {
+        vm->predictor = predictor;
+    }
+    vm->snapshotFile = snapshotFile;
+    vm->verbosity = verbosity;
+    vm->outputFormat = outputFormat;
+    //the caches and the sampled windows are reported with the rest of the pipeline statistics
+    icache.missPenalty = missPenalty;
+    dcache.missPenalty = missPenalty;
+    if((icache.size != 0 && (vm->icache = createCache(vm, &icache)) == NULL)
+            || (dcache.size != 0 && (vm->dcache = createCache(vm, &dcache)) == NULL)) {
+        fprintf(stderr, "unable to allocate caches\n");
+        exit(1);
+    }
+    vm->sampleSkip = sampleSkip;
+    vm->sampleWindow = sampleWindow;
+    vm->sampleWarmup = sampleWarmup;
+    vm->sampleMarker = sampleMarker;
+    if((caches || sampleWindow != 0) && stats == STATS_OFF) {
+        stats = STATS_TEXT;
     }
 
-    return 0;
-}
\ No newline at end of file
+    int status;
+    if(inputDirectory != NULL) {
+        //each job gets a copy of the program and the end of file byte after it
+        settings.image = vm;
+        settings.imageLength = (end + 1ULL < memorySize) ? end + 1 : (unsigned int)memorySize;
+        settings.inputAt = inputAt >= 0 ? (unsigned int)inputAt : (unsigned int)end;
+        status = runBatch(inputDirectory, threads, settings);
+    }
+    else if(stackSize != 0 && !addStackGuard(vm, stackSize, end)) {
+        fprintf(stderr, "program too large for the stack guard\n");
+        status = 1;
+    }
+    else if(forkSource != NULL) {
+        //a restored VM has no program end to put inputs after, it needs --input-at
+        settings.inputAt = inputAt >= 0 ? (unsigned int)inputAt : (unsigned int)end;
+        status = runForkServer(vm, forkSource, forkSocket, checkpoint, threads, settings);
+    }
+    else {
+        //an exact profile steps the fast engine itself, a sampled one watches the chosen engine
+        if(profileFile != NULL) {
+            vm->profile = createProfile(vm);
+            if(profileHz > 0) {
+                startSampling(vm, profileHz);
+            }
+            else {
+                engine = ENGINE_PROFILE;
+            }
+        }
+        if(threaded) {
+            engine = ENGINE_THREADED;
+        }
+        else if(sampleWindow != 0) {
+            engine = ENGINE_SAMPLE;
+        }
+        //the pipeline traces as it stores, any other engine is stepped through the fast engine
+        if(traceFile != NULL) {
+            if(!startTrace(vm, traceFile)) {
+                exit(1);
+            }
+            if(engine != ENGINE_PIPELINE && engine != ENGINE_THREADED) {
+                engine = ENGINE_TRACE;
+            }
+        }
+        //--repeat starts each run again from the VM as loaded, copying back only the memory the last run wrote
+        if(repeat > 1 && !markClean(vm)) {
+            fprintf(stderr, "unable to allocate VM\n");
+            exit(1);
+        }
+        //the VM's output is written by its own thread while it runs
+        fflush(stdout);
+        startOutput(vm);
+        status = runVM(vm, engine);
+        for(int run = 1; run < repeat; run++) {
+            resetVM(vm);
+            status = runVM(vm, engine);
+        }
+        stopOutput(vm);
+        if(traceFile != NULL) {
+            stopTrace(vm);
+        }
+        if(profileFile != NULL) {
+            if(profileHz > 0) {
+                stopSampling(vm);
+            }
+            writeProfile(vm, profileFile);
+            destroyProfile(vm, vm->profile);
+        }
+        if(stats != STATS_OFF) {
+            reportStats(vm, stderr, stats == STATS_JSON);
+        }
+    }
+    destroyVM(vm);
+    return status;
+}